@@ -4,11 +4,15 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -73,224 +77,515 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
-public:
-  virtual ~Expr() = default;
-  virtual void Print(std::ostream &out) const = 0;
-  virtual void DoPrintFormula(std::ostream &out,
-                              ExprPrecedence precedence) const = 0;
-  virtual double Evaluate(std::function<double(Position)> &args) const = 0;
-  virtual ExprPrecedence GetPrecedence() const = 0;
-
-  void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence,
-                    bool right_child = false) const {
-    auto precedence = GetPrecedence();
-    auto mask = right_child ? PR_RIGHT : PR_LEFT;
-    bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-    if (parens_needed) {
-      out << '(';
-    }
+bool IsAggregate(OpCode op) {
+  return op == OpCode::Sum || op == OpCode::Average || op == OpCode::Min ||
+         op == OpCode::Max;
+}
 
-    DoPrintFormula(out, precedence);
+namespace {
+ExprPrecedence GetPrecedence(const Instruction &instruction) {
+  switch (instruction.op) {
+  case OpCode::Add:
+    return EP_ADD;
+  case OpCode::Subtract:
+    return EP_SUB;
+  case OpCode::Multiply:
+    return EP_MUL;
+  case OpCode::Divide:
+    return EP_DIV;
+  case OpCode::UnaryPlus:
+  case OpCode::UnaryMinus:
+    return EP_UNARY;
+  case OpCode::Number:
+  case OpCode::Cell:
+  case OpCode::Range:
+  case OpCode::Sum:
+  case OpCode::Average:
+  case OpCode::Min:
+  case OpCode::Max:
+    return EP_ATOM;
+  default:
+    // have to do this because VC++ has a buggy warning
+    assert(false);
+    return static_cast<ExprPrecedence>(INT_MAX);
+  }
+}
 
-    if (parens_needed) {
-      out << ')';
-    }
+char GetSymbol(OpCode op) {
+  switch (op) {
+  case OpCode::Add:
+  case OpCode::UnaryPlus:
+    return '+';
+  case OpCode::Subtract:
+  case OpCode::UnaryMinus:
+    return '-';
+  case OpCode::Multiply:
+    return '*';
+  case OpCode::Divide:
+    return '/';
+  default:
+    assert(false);
+    return '?';
   }
+}
+
+bool IsBinary(OpCode op) {
+  return op == OpCode::Add || op == OpCode::Subtract ||
+         op == OpCode::Multiply || op == OpCode::Divide;
+}
+
+struct FunctionName {
+  OpCode op;
+  std::string_view name;
 };
 
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-  enum Type : char {
-    Add = '+',
-    Subtract = '-',
-    Multiply = '*',
-    Divide = '/',
-  };
+// Имена агрегатных функций, как в токене FUNCTION грамматики
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {OpCode::Sum, "SUM"},
+    {OpCode::Average, "AVERAGE"},
+    {OpCode::Min, "MIN"},
+    {OpCode::Max, "MAX"},
+};
 
-public:
-  explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs,
-                        std::unique_ptr<Expr> rhs)
-      : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
-
-  void Print(std::ostream &out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    lhs_->Print(out);
-    out << ' ';
-    rhs_->Print(out);
-    out << ')';
-  }
-
-  void DoPrintFormula(std::ostream &out,
-                      ExprPrecedence precedence) const override {
-    lhs_->PrintFormula(out, precedence);
-    out << static_cast<char>(type_);
-    rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-  }
-
-  ExprPrecedence GetPrecedence() const override {
-    switch (type_) {
-    case Add:
-      return EP_ADD;
-    case Subtract:
-      return EP_SUB;
-    case Multiply:
-      return EP_MUL;
-    case Divide:
-      return EP_DIV;
-    default:
-      // have to do this because VC++ has a buggy warning
-      assert(false);
-      return static_cast<ExprPrecedence>(INT_MAX);
-    }
-  }
-
-  double Evaluate(std::function<double(Position)> &args) const override {
-    // Скопируйте ваше решение из предыдущих уроков.
-    auto lhs_value = lhs_->Evaluate(args);
-    auto rhs_value = rhs_->Evaluate(args); 
-    if (type_ == Add &&
-        std::isfinite(lhs_value + rhs_value)) {
-      return lhs_value + rhs_value;
-    } else if (type_ == Subtract &&
-               std::isfinite(lhs_value - rhs_value)) {
-      return lhs_value - rhs_value;
-    } else if (type_ == Multiply &&
-               std::isfinite(lhs_value * rhs_value)) {
-      return lhs_value * rhs_value;
-    } else if (type_ == Divide &&
-               std::isfinite(lhs_value / rhs_value)) {
-      return lhs_value / rhs_value;
-    } else {
-      throw FormulaError(FormulaError::Category::Arithmetic);
+std::string_view GetFunctionName(OpCode op) {
+  for (const auto &function : FUNCTION_NAMES) {
+    if (function.op == op) {
+      return function.name;
     }
   }
+  assert(false);
+  return {};
+}
 
-private:
-  Type type_;
-  std::unique_ptr<Expr> lhs_;
-  std::unique_ptr<Expr> rhs_;
-};
+std::optional<OpCode> FindFunction(std::string_view name) {
+  for (const auto &function : FUNCTION_NAMES) {
+    if (function.name == name) {
+      return function.op;
+    }
+  }
+  return std::nullopt;
+}
 
-class UnaryOpExpr final : public Expr {
-public:
-  enum Type : char {
-    UnaryPlus = '+',
-    UnaryMinus = '-',
-  };
+Instruction MakeFunction(std::string_view name, size_t scalars, size_t ranges) {
+  auto op = FindFunction(name);
+  if (!op) {
+    throw ParsingError("Unknown function: " + std::string(name));
+  }
+  if (scalars + ranges > UINT16_MAX) {
+    throw ParsingError("Too many arguments: " + std::string(name));
+  }
+  return Instruction(*op, Arguments{static_cast<std::uint16_t>(scalars),
+                                    static_cast<std::uint16_t>(ranges)});
+}
 
-public:
-  explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-      : type_(type), operand_(std::move(operand)) {}
+CellRange MakeRange(std::string_view first, std::string_view last) {
+  Position lhs = Position::FromString(first);
+  Position rhs = Position::FromString(last);
+  if (!lhs.IsValid() || !rhs.IsValid()) {
+    throw FormulaException("Invalid range: " + std::string(first) + ':' +
+                           std::string(last));
+  }
+  return CellRange::FromCorners(lhs, rhs);
+}
 
-  void Print(std::ostream &out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    operand_->Print(out);
-    out << ')';
+// Агрегаты по непрерывному массиву чисел. Четыре независимых аккумулятора
+// разрывают зависимость между итерациями: цикл выполняется конвейерно и
+// векторизуется компилятором (сложение и minpd/maxpd из SSE2/AVX) без
+// -ffast-math, поскольку порядок операций задан явно.
+double SumOf(const double *data, size_t size) {
+  double acc[4] = {0.0, 0.0, 0.0, 0.0};
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    acc[0] += data[i];
+    acc[1] += data[i + 1];
+    acc[2] += data[i + 2];
+    acc[3] += data[i + 3];
   }
+  double sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  for (; i < size; ++i) {
+    sum += data[i];
+  }
+  return sum;
+}
 
-  void DoPrintFormula(std::ostream &out,
-                      ExprPrecedence precedence) const override {
-    out << static_cast<char>(type_);
-    operand_->PrintFormula(out, precedence);
+template <typename Compare>
+double ExtremumOf(const double *data, size_t size, Compare better) {
+  assert(size > 0);
+  double acc[4] = {data[0], data[0], data[0], data[0]};
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    for (int lane = 0; lane < 4; ++lane) {
+      acc[lane] = better(data[i + lane], acc[lane]) ? data[i + lane] : acc[lane];
+    }
   }
+  double result = acc[0];
+  for (int lane = 1; lane < 4; ++lane) {
+    result = better(acc[lane], result) ? acc[lane] : result;
+  }
+  for (; i < size; ++i) {
+    result = better(data[i], result) ? data[i] : result;
+  }
+  return result;
+}
 
-  ExprPrecedence GetPrecedence() const override { return EP_UNARY; }
+// Значение агрегатной функции по собранным числам аргументов
+FormulaAST::Value Aggregate(OpCode op, const std::vector<double> &numbers) {
+  const FormulaError arithmetic_error(FormulaError::Category::Arithmetic);
+  double result = 0.0;
+  switch (op) {
+  case OpCode::Sum:
+    result = SumOf(numbers.data(), numbers.size());
+    break;
+  case OpCode::Average:
+    // как и деление на ноль, среднее пустого набора — ошибка
+    if (numbers.empty()) {
+      return arithmetic_error;
+    }
+    result = SumOf(numbers.data(), numbers.size()) / numbers.size();
+    break;
+  case OpCode::Min:
+    if (!numbers.empty()) {
+      result = ExtremumOf(numbers.data(), numbers.size(), std::less<double>());
+    }
+    break;
+  case OpCode::Max:
+    if (!numbers.empty()) {
+      result = ExtremumOf(numbers.data(), numbers.size(), std::greater<double>());
+    }
+    break;
+  default:
+    assert(false);
+  }
+  if (!std::isfinite(result)) {
+    return arithmetic_error;
+  }
+  return result;
+}
 
-  double Evaluate(std::function<double(Position)> &args) const override {
-    // Скопируйте ваше решение из предыдущих уроков.
-    if (type_ == UnaryMinus) {
-      return -operand_->Evaluate(args);
-    } else if (type_ == UnaryPlus) {
-      return operand_->Evaluate(args);
-    } else {
-      assert(false);
+// Бинарная операция; проверку результата на конечность делает вызывающий
+double ApplyBinary(OpCode op, double lhs, double rhs) {
+  switch (op) {
+  case OpCode::Add:
+    return lhs + rhs;
+  case OpCode::Subtract:
+    return lhs - rhs;
+  case OpCode::Multiply:
+    return lhs * rhs;
+  default:
+    return lhs / rhs;
+  }
+}
+
+// Найдётся ли в программе что свернуть: проход без выделений памяти, стек
+// значений — биты «константа» в одном слове. Позволяет не заводить копию
+// программы для большинства формул. При переполнении слова или ошибке в
+// результате свёртки ответ может оказаться ложноположительным.
+bool HasFoldable(const Program &program) {
+  constexpr size_t MAX_DEPTH = 64;
+  uint64_t constants = 0; // младший бит — вершина стека
+  size_t depth = 0;
+  OpCode previous = OpCode::Number;
+  for (const Instruction &instruction : program) {
+    const OpCode op = instruction.op;
+    if (op == OpCode::Number || op == OpCode::Cell) {
+      if (++depth > MAX_DEPTH) {
+        return true;
+      }
+      constants = constants << 1 | (op == OpCode::Number ? 1 : 0);
+    } else if (op == OpCode::UnaryPlus) {
+      return true;
+    } else if (op == OpCode::UnaryMinus) {
+      if ((constants & 1) || previous == OpCode::UnaryMinus) {
+        return true;
+      }
+    } else if (IsBinary(op)) {
+      if ((constants & 3) == 3) {
+        return true;
+      }
+      constants = constants >> 2 << 1;
+      --depth;
+    } else if (IsAggregate(op)) {
+      const size_t scalars = instruction.arguments.scalars;
+      const uint64_t mask = scalars >= MAX_DEPTH ? ~uint64_t{0}
+                                                 : (uint64_t{1} << scalars) - 1;
+      if (instruction.arguments.ranges == 0 && (constants & mask) == mask) {
+        return true;
+      }
+      constants = scalars >= MAX_DEPTH ? 0 : constants >> scalars << 1;
+      depth = depth - scalars + 1;
     }
+    previous = op;
   }
+  return false;
+}
 
-private:
-  Type type_;
-  std::unique_ptr<Expr> operand_;
-};
+// Программа для вычисления со свёрнутыми константами. Поддеревья из одних
+// чисел заменяются числом, посчитанным теми же операциями в том же
+// порядке, поэтому результат совпадает с вычислением исходной программы.
+// Подвыражение, которое дало бы ошибку (деление на ноль, переполнение),
+// не сворачивается и выдаст #ARITHM! при вычислении, как и раньше.
+// Кроме того, убираются унарный плюс и двойное отрицание: вычисление не
+// проверяет их результат. Тождества вроде x*1 не применяются — для
+// бесконечного x они скрыли бы ошибку. Пустая программа — сворачивать
+// нечего.
+Program FoldConstants(const Program &program) {
+  std::pmr::memory_resource *resource = program.get_allocator().resource();
+  Program folded(resource);
+  if (!HasFoldable(program)) {
+    return folded;
+  }
+  folded.reserve(program.size());
 
-class CellExpr final : public Expr {
-public:
-  explicit CellExpr(const Position *cell) : cell_(cell) {}
+  // Значения на стеке: константа ли и где начинается её код в folded
+  struct Operand {
+    bool constant;
+    double value;
+    size_t begin;
+  };
+  std::pmr::vector<Operand> operands(resource);
+  std::vector<double> numbers;
+  auto push_constant = [&](size_t begin, double value) {
+    folded.erase(folded.begin() + begin, folded.end());
+    folded.emplace_back(OpCode::Number, value);
+    operands.push_back({true, value, begin});
+  };
 
-  void Print(std::ostream &out) const override {
-    if (!cell_->IsValid()) {
-      out << FormulaError::Category::Ref;
+  for (const Instruction &instruction : program) {
+    const OpCode op = instruction.op;
+    if (op == OpCode::Number) {
+      push_constant(folded.size(), instruction.number);
+    } else if (op == OpCode::Cell) {
+      folded.push_back(instruction);
+      operands.push_back({false, 0.0, folded.size() - 1});
+    } else if (op == OpCode::Range) {
+      folded.push_back(instruction);
+    } else if (op == OpCode::UnaryPlus) {
+      continue;
+    } else if (op == OpCode::UnaryMinus) {
+      Operand &operand = operands.back();
+      if (operand.constant) {
+        const size_t begin = operand.begin;
+        const double value = -operand.value;
+        operands.pop_back();
+        push_constant(begin, value);
+      } else if (folded.back().op == OpCode::UnaryMinus) {
+        folded.pop_back();
+      } else {
+        folded.push_back(instruction);
+      }
+    } else if (IsBinary(op)) {
+      const Operand rhs = operands.back();
+      operands.pop_back();
+      const Operand lhs = operands.back();
+      operands.pop_back();
+      const double result = ApplyBinary(op, lhs.value, rhs.value);
+      if (lhs.constant && rhs.constant && std::isfinite(result)) {
+        push_constant(lhs.begin, result);
+      } else {
+        folded.push_back(instruction);
+        operands.push_back({false, 0.0, lhs.begin});
+      }
     } else {
-      out << cell_->ToString();
+      const Arguments &arguments = instruction.arguments;
+      const auto first = operands.end() - arguments.scalars;
+      const bool constant =
+          arguments.ranges == 0 &&
+          std::all_of(first, operands.end(),
+                      [](const Operand &operand) { return operand.constant; });
+      std::optional<FormulaAST::Value> result;
+      if (constant) {
+        numbers.clear();
+        for (auto it = first; it != operands.end(); ++it) {
+          numbers.push_back(it->value);
+        }
+        result = Aggregate(op, numbers);
+      }
+      const size_t begin =
+          arguments.scalars > 0 ? first->begin : folded.size();
+      operands.erase(first, operands.end());
+      if (result && std::holds_alternative<double>(*result)) {
+        push_constant(begin, std::get<double>(*result));
+      } else {
+        folded.push_back(instruction);
+        operands.push_back({false, 0.0, begin});
+      }
     }
   }
 
-  void DoPrintFormula(std::ostream &out,
-                      ExprPrecedence /* precedence */) const override {
-    Print(out);
+  if (folded.size() == program.size()) {
+    return Program(resource);
   }
+  folded.shrink_to_fit();
+  return folded;
+}
 
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
-
-  double Evaluate(std::function<double(Position)> &args) const override {
-    // реализуйте метод.
-    return args(*cell_);
+// Печать формулы по программе в обратной польской записи. Для каждой
+// инструкции заранее находится начало её подвыражения, после чего
+// операнды бинарной операции на позиции i лежат так: правый заканчивается
+// на i - 1, левый — прямо перед началом правого.
+class ProgramPrinter {
+public:
+  explicit ProgramPrinter(const Program &program)
+      : program_(program), begins_(program.size()) {
+    for (size_t i = 0; i < program_.size(); ++i) {
+      OpCode op = program_[i].op;
+      if (IsBinary(op)) {
+        begins_[i] = begins_[begins_[i - 1] - 1];
+      } else if (op == OpCode::UnaryPlus || op == OpCode::UnaryMinus) {
+        begins_[i] = begins_[i - 1];
+      } else if (IsAggregate(op)) {
+        const Arguments &arguments = program_[i].arguments;
+        size_t begin = i;
+        for (size_t k = 0; k < size_t(arguments.scalars) + arguments.ranges;
+             ++k) {
+          begin = begins_[begin - 1];
+        }
+        begins_[i] = begin;
+      } else {
+        begins_[i] = i;
+      }
+    }
   }
 
-private:
-  const Position *cell_;
-};
+  void Print(std::ostream &out, size_t index) const {
+    const Instruction &instruction = program_[index];
+    switch (instruction.op) {
+    case OpCode::Number:
+      out << instruction.number;
+      break;
+    case OpCode::Cell:
+      PrintCell(out, instruction.cell);
+      break;
+    case OpCode::Range:
+      out << instruction.range.ToString();
+      break;
+    case OpCode::UnaryPlus:
+    case OpCode::UnaryMinus:
+      out << '(' << GetSymbol(instruction.op) << ' ';
+      Print(out, index - 1);
+      out << ')';
+      break;
+    case OpCode::Sum:
+    case OpCode::Average:
+    case OpCode::Min:
+    case OpCode::Max:
+      out << '(' << GetFunctionName(instruction.op);
+      for (size_t argument : ArgumentEnds(index)) {
+        out << ' ';
+        Print(out, argument);
+      }
+      out << ')';
+      break;
+    default:
+      out << '(' << GetSymbol(instruction.op) << ' ';
+      Print(out, LeftOperand(index));
+      out << ' ';
+      Print(out, index - 1);
+      out << ')';
+    }
+  }
 
-class NumberExpr final : public Expr {
-public:
-  explicit NumberExpr(double value) : value_(value) {}
+  void PrintFormula(std::ostream &out, size_t index,
+                    ExprPrecedence parent_precedence,
+                    bool right_child = false) const {
+    auto precedence = GetPrecedence(program_[index]);
+    auto mask = right_child ? PR_RIGHT : PR_LEFT;
+    bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+    if (parens_needed) {
+      out << '(';
+    }
 
-  void Print(std::ostream &out) const override { out << value_; }
+    DoPrintFormula(out, index, precedence);
 
-  void DoPrintFormula(std::ostream &out,
-                      ExprPrecedence /* precedence */) const override {
-    out << value_;
+    if (parens_needed) {
+      out << ')';
+    }
   }
 
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
+private:
+  const Program &program_;
+  std::vector<size_t> begins_;
+
+  size_t LeftOperand(size_t index) const { return begins_[index - 1] - 1; }
+
+  // Последние инструкции аргументов агрегатной функции в порядке записи
+  std::vector<size_t> ArgumentEnds(size_t index) const {
+    const Arguments &arguments = program_[index].arguments;
+    std::vector<size_t> ends(size_t(arguments.scalars) + arguments.ranges);
+    size_t end = index - 1;
+    for (auto it = ends.rbegin(); it != ends.rend(); ++it) {
+      *it = end;
+      end = begins_[end] - 1;
+    }
+    return ends;
+  }
 
-  double Evaluate(std::function<double(Position)> &) const override {
-    return value_;
+  static void PrintCell(std::ostream &out, Position cell) {
+    if (!cell.IsValid()) {
+      out << FormulaError::Category::Ref;
+    } else {
+      out << cell.ToString();
+    }
   }
 
-private:
-  double value_;
+  void DoPrintFormula(std::ostream &out, size_t index,
+                      ExprPrecedence precedence) const {
+    const Instruction &instruction = program_[index];
+    switch (instruction.op) {
+    case OpCode::Number:
+      out << instruction.number;
+      break;
+    case OpCode::Cell:
+      PrintCell(out, instruction.cell);
+      break;
+    case OpCode::Range:
+      out << instruction.range.ToString();
+      break;
+    case OpCode::UnaryPlus:
+    case OpCode::UnaryMinus:
+      out << GetSymbol(instruction.op);
+      PrintFormula(out, index - 1, precedence);
+      break;
+    case OpCode::Sum:
+    case OpCode::Average:
+    case OpCode::Min:
+    case OpCode::Max: {
+      out << GetFunctionName(instruction.op) << '(';
+      bool first = true;
+      for (size_t argument : ArgumentEnds(index)) {
+        if (!first) {
+          out << ',';
+        }
+        first = false;
+        PrintFormula(out, argument, EP_ATOM);
+      }
+      out << ')';
+      break;
+    }
+    default:
+      PrintFormula(out, LeftOperand(index), precedence);
+      out << GetSymbol(instruction.op);
+      PrintFormula(out, index - 1, precedence, /* right_child = */ true);
+    }
+  }
 };
 
+// Обход дерева разбора ANTLR идёт в обратном порядке (операнды раньше
+// операции), поэтому программа строится прямо в обработчиках exit*.
 class ParseASTListener final : public FormulaBaseListener {
 public:
-  std::unique_ptr<Expr> MoveRoot() {
-    assert(args_.size() == 1);
-    auto root = std::move(args_.front());
-    args_.clear();
-
-    return root;
-  }
+  Program MoveProgram() { return std::move(program_); }
 
-  std::forward_list<Position> MoveCells() { return std::move(cells_); }
+  std::pmr::forward_list<Position> MoveCells() { return std::move(cells_); }
 
 public:
   void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override {
-    assert(args_.size() >= 1);
-
-    auto operand = std::move(args_.back());
-
-    UnaryOpExpr::Type type;
     if (ctx->SUB()) {
-      type = UnaryOpExpr::UnaryMinus;
+      program_.emplace_back(OpCode::UnaryMinus);
     } else {
       assert(ctx->ADD() != nullptr);
-      type = UnaryOpExpr::UnaryPlus;
+      program_.emplace_back(OpCode::UnaryPlus);
     }
-
-    auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-    args_.back() = std::move(node);
   }
 
   void exitLiteral(FormulaParser::LiteralContext *ctx) override {
@@ -302,8 +597,7 @@ public:
       throw ParsingError("Invalid number: " + valueStr);
     }
 
-    auto node = std::make_unique<NumberExpr>(value);
-    args_.push_back(std::move(node));
+    program_.emplace_back(OpCode::Number, value);
   }
 
   void exitCell(FormulaParser::CellContext *ctx) override {
@@ -314,33 +608,39 @@ public:
     }
 
     cells_.push_front(value);
-    auto node = std::make_unique<CellExpr>(&cells_.front());
-    args_.push_back(std::move(node));
+    program_.emplace_back(value);
   }
 
   void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override {
-    assert(args_.size() >= 2);
-
-    auto rhs = std::move(args_.back());
-    args_.pop_back();
-
-    auto lhs = std::move(args_.back());
-
-    BinaryOpExpr::Type type;
+    OpCode op;
     if (ctx->ADD())
-      type = BinaryOpExpr::Add;
+      op = OpCode::Add;
     else if (ctx->SUB())
-      type = BinaryOpExpr::Subtract;
+      op = OpCode::Subtract;
     else if (ctx->MUL())
-      type = BinaryOpExpr::Multiply;
+      op = OpCode::Multiply;
     else {
       assert(ctx->DIV() != nullptr);
-      type = BinaryOpExpr::Divide;
+      op = OpCode::Divide;
     }
+    program_.emplace_back(op);
+  }
+
+  void exitRangeArgument(FormulaParser::RangeArgumentContext *ctx) override {
+    program_.emplace_back(MakeRange(ctx->CELL(0)->getSymbol()->getText(),
+                                    ctx->CELL(1)->getSymbol()->getText()));
+  }
 
-    auto node =
-        std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-    args_.back() = std::move(node);
+  void exitFunction(FormulaParser::FunctionContext *ctx) override {
+    size_t ranges = 0;
+    auto arguments = ctx->argument();
+    for (auto *argument : arguments) {
+      if (dynamic_cast<FormulaParser::RangeArgumentContext *>(argument)) {
+        ++ranges;
+      }
+    }
+    program_.push_back(MakeFunction(ctx->FUNCTION()->getSymbol()->getText(),
+                                    arguments.size() - ranges, ranges));
   }
 
   void visitErrorNode(antlr4::tree::ErrorNode *node) override {
@@ -348,8 +648,8 @@ public:
   }
 
 private:
-  std::vector<std::unique_ptr<Expr>> args_;
-  std::forward_list<Position> cells_;
+  Program program_;
+  std::pmr::forward_list<Position> cells_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -362,6 +662,313 @@ public:
   }
 };
 
+// Разбор без ANTLR: лексер и парсер с приоритетами операций (Pratt) прямо
+// по строке. Повторяет грамматику Formula.g4 вместе с правилами лексера
+// ANTLR (берётся самое длинное совпадение, пробелы пропускаются) и строит ту
+// же программу, что и ParseASTListener. Токены — это string_view во входную
+// строку, так что память выделяется только под саму программу и список ячеек.
+class PrattParser {
+public:
+  PrattParser(std::string_view text, std::pmr::memory_resource *resource)
+      : text_(text), program_(resource), cells_(resource) {
+    program_.reserve(text.size() / 2 + 1);
+  }
+
+  FormulaAST Parse() {
+    Next();
+    ParseExpr(PREC_ADD);
+    if (token_.type != TokenType::End) {
+      Fail();
+    }
+    return FormulaAST(std::move(program_), std::move(cells_));
+  }
+
+private:
+  enum class TokenType {
+    Number,
+    Cell,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Function,
+    Colon,
+    Comma,
+    End,
+  };
+
+  struct Token {
+    TokenType type = TokenType::End;
+    std::string_view text;
+  };
+
+  // Приоритеты как в Formula.g4: унарные операции связывают сильнее бинарных
+  enum Precedence {
+    PREC_ADD = 1,
+    PREC_MUL = 2,
+    PREC_UNARY = 3,
+  };
+
+  [[noreturn]] static void Fail() {
+    throw ParsingError("Syntactically invalid formula");
+  }
+
+  static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+  static bool IsUpper(char c) { return c >= 'A' && c <= 'Z'; }
+
+  size_t SkipDigits(size_t pos) const {
+    while (pos < text_.size() && IsDigit(text_[pos])) {
+      ++pos;
+    }
+    return pos;
+  }
+
+  bool DigitAt(size_t pos) const {
+    return pos < text_.size() && IsDigit(text_[pos]);
+  }
+
+  // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+  size_t ScanNumber(size_t begin) const {
+    size_t end = SkipDigits(begin);
+    if (end < text_.size() && text_[end] == '.' && DigitAt(end + 1)) {
+      end = SkipDigits(end + 1);
+    } else if (end == begin) {
+      return begin;
+    }
+
+    if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+      size_t exponent = end + 1;
+      if (exponent < text_.size() &&
+          (text_[exponent] == '+' || text_[exponent] == '-')) {
+        ++exponent;
+      }
+      if (DigitAt(exponent)) {
+        end = SkipDigits(exponent);
+      }
+    }
+    return end;
+  }
+
+  void Next() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' ||
+            text_[pos_] == '\r')) {
+      ++pos_;
+    }
+    if (pos_ == text_.size()) {
+      token_ = {TokenType::End, {}};
+      return;
+    }
+
+    size_t begin = pos_;
+    size_t end = begin + 1;
+    TokenType type;
+    switch (text_[begin]) {
+    case '+':
+      type = TokenType::Add;
+      break;
+    case '-':
+      type = TokenType::Sub;
+      break;
+    case '*':
+      type = TokenType::Mul;
+      break;
+    case '/':
+      type = TokenType::Div;
+      break;
+    case '(':
+      type = TokenType::LeftParen;
+      break;
+    case ')':
+      type = TokenType::RightParen;
+      break;
+    case ':':
+      type = TokenType::Colon;
+      break;
+    case ',':
+      type = TokenType::Comma;
+      break;
+    default:
+      if (IsUpper(text_[begin])) {
+        // CELL: [A-Z]+[0-9]+, без цифр — имя функции
+        while (end < text_.size() && IsUpper(text_[end])) {
+          ++end;
+        }
+        if (DigitAt(end)) {
+          end = SkipDigits(end);
+          type = TokenType::Cell;
+        } else if (FindFunction(text_.substr(begin, end - begin))) {
+          type = TokenType::Function;
+        } else {
+          Fail();
+        }
+      } else {
+        end = ScanNumber(begin);
+        if (end == begin) {
+          Fail();
+        }
+        type = TokenType::Number;
+      }
+    }
+
+    token_ = {type, text_.substr(begin, end - begin)};
+    pos_ = end;
+  }
+
+  void Expect(TokenType type) {
+    if (token_.type != type) {
+      Fail();
+    }
+    Next();
+  }
+
+  void ParseExpr(int min_precedence) {
+    ParsePrefix();
+    ParseOperators(min_precedence);
+  }
+
+  // Бинарные операции после уже разобранного левого операнда
+  void ParseOperators(int min_precedence) {
+    while (true) {
+      OpCode op;
+      int precedence;
+      switch (token_.type) {
+      case TokenType::Add:
+        op = OpCode::Add;
+        precedence = PREC_ADD;
+        break;
+      case TokenType::Sub:
+        op = OpCode::Subtract;
+        precedence = PREC_ADD;
+        break;
+      case TokenType::Mul:
+        op = OpCode::Multiply;
+        precedence = PREC_MUL;
+        break;
+      case TokenType::Div:
+        op = OpCode::Divide;
+        precedence = PREC_MUL;
+        break;
+      default:
+        return;
+      }
+      if (precedence < min_precedence) {
+        return;
+      }
+      Next();
+      // Левая ассоциативность: справа только более сильные операции
+      ParseExpr(precedence + 1);
+      program_.emplace_back(op);
+    }
+  }
+
+  void ParsePrefix() {
+    switch (token_.type) {
+    case TokenType::LeftParen:
+      Next();
+      ParseExpr(PREC_ADD);
+      Expect(TokenType::RightParen);
+      break;
+    case TokenType::Add:
+    case TokenType::Sub: {
+      OpCode op = token_.type == TokenType::Add ? OpCode::UnaryPlus
+                                                : OpCode::UnaryMinus;
+      Next();
+      ParseExpr(PREC_UNARY);
+      program_.emplace_back(op);
+      break;
+    }
+    case TokenType::Cell:
+      EmitCell(token_.text);
+      Next();
+      break;
+    case TokenType::Number:
+      program_.emplace_back(OpCode::Number, ParseNumber(token_.text));
+      Next();
+      break;
+    case TokenType::Function:
+      ParseFunction();
+      break;
+    default:
+      Fail();
+    }
+  }
+
+  void EmitCell(std::string_view text) {
+    Position cell = Position::FromString(text);
+    if (!cell.IsValid()) {
+      throw FormulaException("Invalid position: " + std::string(text));
+    }
+    cells_.push_front(cell);
+    program_.emplace_back(cell);
+  }
+
+  // FUNCTION '(' argument (',' argument)* ')', где argument — диапазон
+  // CELL ':' CELL или выражение
+  void ParseFunction() {
+    std::string_view name = token_.text;
+    Next();
+    Expect(TokenType::LeftParen);
+    size_t scalars = 0;
+    size_t ranges = 0;
+    while (true) {
+      if (token_.type == TokenType::Cell) {
+        std::string_view first = token_.text;
+        Next();
+        if (token_.type == TokenType::Colon) {
+          Next();
+          if (token_.type != TokenType::Cell) {
+            Fail();
+          }
+          program_.emplace_back(MakeRange(first, token_.text));
+          Next();
+          ++ranges;
+        } else {
+          // Одиночная ячейка — начало выражения
+          EmitCell(first);
+          ParseOperators(PREC_ADD);
+          ++scalars;
+        }
+      } else {
+        ParseExpr(PREC_ADD);
+        ++scalars;
+      }
+      if (token_.type != TokenType::Comma) {
+        break;
+      }
+      Next();
+    }
+    Expect(TokenType::RightParen);
+    program_.push_back(MakeFunction(name, scalars, ranges));
+  }
+
+  // Значение совпадает с тем, что даёт operator>> в ParseASTListener:
+  // переполнение — ошибка, исчезновение порядка — обычное значение strtod.
+  static double ParseNumber(std::string_view text) {
+    double value = 0;
+    auto [end, error] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error == std::errc::result_out_of_range) {
+      value = std::strtod(std::string(text).c_str(), nullptr);
+    } else if (error != std::errc() || end != text.data() + text.size()) {
+      Fail();
+    }
+    if (std::isinf(value)) {
+      throw ParsingError("Invalid number: " + std::string(text));
+    }
+    return value;
+  }
+
+  std::string_view text_;
+  size_t pos_ = 0;
+  Token token_;
+  Program program_;
+  std::pmr::forward_list<Position> cells_;
+};
+
 } // namespace
 
 } // namespace ASTImpl
@@ -387,13 +994,13 @@ FormulaAST ParseFormulaAST(std::istream &in) {
   ASTImpl::ParseASTListener listener;
   tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-  return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+  return FormulaAST(listener.MoveProgram(), listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string &in_str) {
-  std::istringstream in(in_str);
+FormulaAST ParseFormulaAST(const std::string &in_str,
+                           std::pmr::memory_resource *resource) {
   try {
-    return ParseFormulaAST(in);
+    return ASTImpl::PrattParser(in_str, resource).Parse();
   } catch (...) {
     throw FormulaException("Syntactically invalid formula");
   }
@@ -404,20 +1011,151 @@ void FormulaAST::PrintCells(std::ostream &out) const {
     out << cell.ToString() << ' ';
 }
 
-void FormulaAST::Print(std::ostream &out) const { root_expr_->Print(out); }
+void FormulaAST::Print(std::ostream &out) const {
+  ASTImpl::ProgramPrinter(program_).Print(out, program_.size() - 1);
+}
 
 void FormulaAST::PrintFormula(std::ostream &out) const {
-  root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+  ASTImpl::ProgramPrinter(program_).PrintFormula(out, program_.size() - 1,
+                                                 ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(std::function<double(Position)> &args) const {
-  return root_expr_->Evaluate(/*добавьте нужные аргументы*/ args);
+FormulaAST::Value
+FormulaAST::Execute(const CellValueGetter &args,
+                    const RangeNumbersGetter &range_numbers) const {
+  using ASTImpl::OpCode;
+
+  // Неглубокие формулы обходятся стеками на самом стеке вызовов
+  constexpr size_t INLINE_STACK_DEPTH = 32;
+  double inline_stack[INLINE_STACK_DEPTH];
+  std::vector<double> heap_stack;
+  double *stack = inline_stack;
+  if (stack_depth_ > INLINE_STACK_DEPTH) {
+    heap_stack.resize(stack_depth_);
+    stack = heap_stack.data();
+  }
+
+  // Диапазоны ждут своей агрегатной функции на отдельном стеке
+  constexpr size_t INLINE_RANGE_DEPTH = 8;
+  const CellRange *inline_ranges[INLINE_RANGE_DEPTH];
+  std::vector<const CellRange *> heap_ranges;
+  const CellRange **ranges = inline_ranges;
+  if (range_depth_ > INLINE_RANGE_DEPTH) {
+    heap_ranges.resize(range_depth_);
+    ranges = heap_ranges.data();
+  }
+  // Числа аргументов агрегатной функции подряд в памяти. Буфер свой у
+  // каждого вызова: чтение диапазона может вычислить другую формулу.
+  std::vector<double> numbers;
+
+  size_t top = 0;        // число значений на стеке
+  size_t ranges_top = 0; // число диапазонов на стеке
+  for (const ASTImpl::Instruction &instruction : GetEvalProgram()) {
+    switch (instruction.op) {
+    case OpCode::Number:
+      stack[top++] = instruction.number;
+      break;
+    case OpCode::Cell: {
+      Value value = args(instruction.cell);
+      if (auto *error = std::get_if<FormulaError>(&value)) {
+        return *error;
+      }
+      stack[top++] = std::get<double>(value);
+      break;
+    }
+    case OpCode::Range:
+      ranges[ranges_top++] = &instruction.range;
+      break;
+    case OpCode::UnaryPlus:
+      break;
+    case OpCode::UnaryMinus:
+      stack[top - 1] = -stack[top - 1];
+      break;
+    case OpCode::Sum:
+    case OpCode::Average:
+    case OpCode::Min:
+    case OpCode::Max: {
+      const ASTImpl::Arguments &arguments = instruction.arguments;
+      numbers.clear();
+      ranges_top -= arguments.ranges;
+      for (size_t i = 0; i < arguments.ranges; ++i) {
+        if (auto error = range_numbers(*ranges[ranges_top + i], numbers)) {
+          return *error;
+        }
+      }
+      top -= arguments.scalars;
+      numbers.insert(numbers.end(), stack + top,
+                     stack + top + arguments.scalars);
+
+      Value result = ASTImpl::Aggregate(instruction.op, numbers);
+      if (auto *error = std::get_if<FormulaError>(&result)) {
+        return *error;
+      }
+      stack[top++] = std::get<double>(result);
+      break;
+    }
+    default: {
+      double rhs_value = stack[--top];
+      double lhs_value = stack[top - 1];
+      double result = ASTImpl::ApplyBinary(instruction.op, lhs_value, rhs_value);
+      if (!std::isfinite(result)) {
+        return FormulaError(FormulaError::Category::Arithmetic);
+      }
+      stack[top - 1] = result;
+    }
+    }
+  }
+
+  assert(top == 1 && ranges_top == 0);
+  return stack[0];
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                       std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
+FormulaAST::FormulaAST(ASTImpl::Program program,
+                       std::pmr::forward_list<Position> cells)
+    : program_(std::move(program)), eval_program_(program_.get_allocator()),
+      ranges_(program_.get_allocator()), cells_(std::move(cells)) {
+  using ASTImpl::OpCode;
+
+  // Программа может прийти не от парсера (см. LoadFormula), поэтому
+  // каждой операции проверяется наличие операндов
+  auto fail = [] { throw ParsingError("Malformed formula program"); };
+  size_t depth = 0;
+  size_t range_depth = 0;
+  for (const auto &instruction : program_) {
+    if (instruction.op == OpCode::Number || instruction.op == OpCode::Cell) {
+      stack_depth_ = std::max(stack_depth_, ++depth);
+    } else if (instruction.op == OpCode::UnaryPlus ||
+               instruction.op == OpCode::UnaryMinus) {
+      if (depth < 1) {
+        fail();
+      }
+    } else if (ASTImpl::IsBinary(instruction.op)) {
+      if (depth < 2) {
+        fail();
+      }
+      --depth;
+    } else if (instruction.op == OpCode::Range) {
+      ranges_.push_back(instruction.range);
+      range_depth_ = std::max(range_depth_, ++range_depth);
+    } else if (ASTImpl::IsAggregate(instruction.op)) {
+      const ASTImpl::Arguments &arguments = instruction.arguments;
+      if (depth < arguments.scalars || range_depth < arguments.ranges ||
+          arguments.scalars + arguments.ranges == 0) {
+        fail();
+      }
+      depth -= arguments.scalars;
+      range_depth -= arguments.ranges;
+      stack_depth_ = std::max(stack_depth_, ++depth);
+    } else {
+      fail();
+    }
+  }
+  if (depth != 1 || range_depth != 0) {
+    fail();
+  }
+
   cells_.sort(); // to avoid sorting in GetReferencedCells
+  eval_program_ = ASTImpl::FoldConstants(program_);
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::~FormulaAST() = default;
@@ -3,13 +3,66 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
-}
+enum class OpCode : std::uint8_t {
+    Number,
+    Cell,
+    UnaryPlus,
+    UnaryMinus,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Range,  // аргумент агрегатной функции; на стек значений не кладётся
+    Sum,
+    Average,
+    Min,
+    Max,
+};
+
+// Число аргументов агрегатной функции: значений на стеке и диапазонов
+struct Arguments {
+    std::uint16_t scalars;
+    std::uint16_t ranges;
+};
+
+// Инструкция программы формулы. Программа хранится в обратной польской
+// записи: операнды идут раньше операции, поэтому вычисляется одним проходом
+// со стеком значений, без рекурсии и виртуальных вызовов.
+struct Instruction {
+    explicit Instruction(OpCode op, double number = 0.0)
+        : op(op), number(number) {
+    }
+    explicit Instruction(Position cell) : op(OpCode::Cell), cell(cell) {
+    }
+    explicit Instruction(CellRange range) : op(OpCode::Range), range(range) {
+    }
+    Instruction(OpCode op, Arguments arguments) : op(op), arguments(arguments) {
+    }
+
+    OpCode op;
+    union {
+        double number;        // для OpCode::Number
+        Position cell;        // для OpCode::Cell
+        CellRange range;      // для OpCode::Range
+        Arguments arguments;  // для агрегатных функций
+    };
+};
+
+// Программа формулы и ячейки, на которые она ссылается, размещаются в
+// переданном парсеру ресурсе памяти (у ячеек листа это память листа)
+using Program = std::pmr::vector<Instruction>;
+
+bool IsAggregate(OpCode op);
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,33 +70,70 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // Результат вычисления: число либо ошибка. Ошибки передаются как
+    // значения, исключения при вычислении не используются.
+    using Value = std::variant<double, FormulaError>;
+    using CellValueGetter = std::function<Value(Position)>;
+    // Дописывает числа диапазона в конец вектора, см.
+    // SheetInterface::GetRangeNumbers
+    using RangeNumbersGetter =
+        std::function<std::optional<FormulaError>(CellRange, std::vector<double>&)>;
+
+    // ranges_ размещаются в ресурсе памяти программы
+    explicit FormulaAST(ASTImpl::Program program,
+                        std::pmr::forward_list<Position> cells);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<double(Position)>& args) const;
+    Value Execute(const CellValueGetter& args,
+                  const RangeNumbersGetter& range_numbers) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells() {
+    std::pmr::forward_list<Position>& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const std::pmr::forward_list<Position>& GetCells() const {
         return cells_;
     }
 
+    // Программа в том виде, в каком записана формула; по ней печатается
+    // выражение и сохраняется лист
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
+    }
+
+    // Программа, которая выполняется: со свёрнутыми константами, если было
+    // что сворачивать, иначе исходная
+    const ASTImpl::Program& GetEvalProgram() const {
+        return eval_program_.empty() ? program_ : eval_program_;
+    }
+
+    // Диапазоны из аргументов агрегатных функций в порядке записи
+    const std::pmr::vector<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ASTImpl::Program program_;
+    // program_ со свёрнутыми константами; пуста, если свернуть нечего
+    ASTImpl::Program eval_program_;
+    // наибольшая глубина стека значений при выполнении program_
+    size_t stack_depth_ = 0;
+    // наибольшее число диапазонов, ждущих своей агрегатной функции
+    size_t range_depth_ = 0;
+    std::pmr::vector<CellRange> ranges_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::pmr::forward_list<Position> cells_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(
+    const std::string& in_str,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
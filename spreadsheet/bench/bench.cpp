@@ -0,0 +1,1116 @@
+#include "binary_snapshot.h"
+#include "common.h"
+#include "formula.h"
+#include "positions_set.h"
+#include "sheet.h"
+#include "text_import.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Счётчики выделений из общей кучи: сценарий allocations сравнивает число
+// выделений и занятую память на ячейку. Размер выделения хранится в
+// заголовке перед блоком, так что учитывается вся память, включая пулы
+// листа.
+std::atomic<size_t> heap_allocations{0};
+std::atomic<size_t> heap_bytes{0};
+
+void* CountedAllocate(std::size_t size, std::size_t alignment) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    // Заголовок занимает целое число выравниваний, чтобы блок остался выровнен
+    const size_t header = std::max(alignment, alignof(std::max_align_t));
+    const size_t total = (size + 2 * header - 1) / header * header;
+    if (auto* memory = static_cast<unsigned char*>(std::aligned_alloc(header, total))) {
+        std::memcpy(memory + header - 2 * sizeof(size_t), &size, sizeof(size));
+        std::memcpy(memory + header - sizeof(size_t), &header, sizeof(header));
+        return memory + header;
+    }
+    throw std::bad_alloc();
+}
+
+void CountedFree(void* memory) noexcept {
+    if (!memory) {
+        return;
+    }
+    auto* block = static_cast<unsigned char*>(memory);
+    size_t size;
+    size_t header;
+    std::memcpy(&size, block - 2 * sizeof(size_t), sizeof(size));
+    std::memcpy(&header, block - sizeof(size_t), sizeof(header));
+    heap_bytes.fetch_sub(size, std::memory_order_relaxed);
+    std::free(block - header);
+}
+
+void* operator new(std::size_t size) {
+    return CountedAllocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept {
+    CountedFree(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    CountedFree(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept {
+    CountedFree(memory);
+}
+
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept {
+    CountedFree(memory);
+}
+
+namespace {
+
+struct Scenario {
+    std::string name;
+    std::function<void()> run;
+};
+
+// Параметры запуска: множитель размеров сценариев, формат и файл результатов
+struct Options {
+    double scale = 1;
+    std::string format = "tsv";
+    std::string output;
+    std::string trace;
+    std::vector<std::string> scenarios;
+    bool list = false;
+};
+
+struct Result {
+    std::string scenario;
+    std::string metric;
+    double value;
+};
+
+Options options;
+std::vector<Result> results;
+
+// Размер сценария с учётом --scale; не меньше 4, чтобы цепочки и сетки не
+// вырождались
+int Scaled(int size) {
+    return std::max(4, static_cast<int>(size * options.scale));
+}
+
+// Строка JSON; имена сценариев и метрик — идентификаторы, но экранируются
+// на всякий случай
+std::string Quote(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+// Нечисловые значения в JSON записываются как null
+std::string FormatValue(double value, bool json) {
+    if (json && !std::isfinite(value)) {
+        return "null";
+    }
+    std::ostringstream out;
+    out.precision(12);
+    out << value;
+    return out.str();
+}
+
+template <typename Func>
+double MeasureMs(Func&& func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(finish - start).count();
+}
+
+void Report(const std::string& scenario, const std::string& metric, double value) {
+    results.push_back({scenario, metric, value});
+    if (options.format == "tsv" && options.output.empty()) {
+        std::cout << scenario << '\t' << metric << '\t' << FormatValue(value, false) << '\n';
+    }
+}
+
+// Плотный прямоугольник чисел: заполнение, поиск каждой ячейки и печать
+void BenchDenseSheet() {
+    const int ROWS = Scaled(512);
+    constexpr int COLS = 128;
+    auto sheet = CreateSheet();
+
+    Report("dense_sheet", "fill_ms", MeasureMs([&] {
+               for (int row = 0; row < ROWS; ++row) {
+                   for (int col = 0; col < COLS; ++col) {
+                       sheet->SetCell({row, col}, std::to_string(row + col));
+                   }
+               }
+           }));
+
+    size_t found = 0;
+    Report("dense_sheet", "lookup_ms", MeasureMs([&] {
+               for (int row = 0; row < ROWS; ++row) {
+                   for (int col = 0; col < COLS; ++col) {
+                       found += sheet->GetCell({row, col}) != nullptr;
+                   }
+               }
+           }));
+
+    std::ostringstream out;
+    Report("dense_sheet", "print_values_ms", MeasureMs([&] {
+               sheet->PrintValues(out);
+           }));
+    Report("dense_sheet", "cells", static_cast<double>(found));
+}
+
+// Случайно разбросанные по всему листу ячейки
+void BenchSparseSheet() {
+    constexpr int CELLS = 20000;
+    auto sheet = CreateSheet();
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> row_dist(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> col_dist(0, Position::MAX_COLS - 1);
+
+    std::vector<Position> positions(CELLS);
+    for (auto& pos : positions) {
+        pos = {row_dist(random), col_dist(random)};
+    }
+
+    Report("sparse_sheet", "fill_ms", MeasureMs([&] {
+               for (Position pos : positions) {
+                   sheet->SetCell(pos, "42");
+               }
+           }));
+
+    size_t found = 0;
+    Report("sparse_sheet", "lookup_ms", MeasureMs([&] {
+               for (int repeat = 0; repeat < 50; ++repeat) {
+                   for (Position pos : positions) {
+                       found += sheet->GetCell(pos) != nullptr;
+                   }
+               }
+           }));
+    Report("sparse_sheet", "found", static_cast<double>(found));
+}
+
+// Многократное вычисление разобранных формул без участия кэша ячеек
+void BenchFormulaEvaluate() {
+    const int FORMULAS = Scaled(10000);
+    constexpr int REPEATS = 50;
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "1.5");
+    sheet->SetCell({0, 1}, "2");
+    sheet->SetCell({0, 2}, "=A1+B1");
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        formulas.push_back(ParseFormula("A1*2+B1/3-(C1+" + std::to_string(i) + ")*5+-A1"));
+    }
+
+    double checksum = 0;
+    Report("formula_evaluate", "evaluate_ms", MeasureMs([&] {
+               for (int repeat = 0; repeat < REPEATS; ++repeat) {
+                   for (const auto& formula : formulas) {
+                       checksum += std::get<double>(formula->Evaluate(*sheet));
+                   }
+               }
+           }));
+    Report("formula_evaluate", "checksum", checksum);
+}
+
+// Формулы с постоянными подвыражениями (пересчёт единиц, коэффициенты):
+// их вычисление после свёртки констант при разборе
+void BenchConstantFolding() {
+    const int FORMULAS = Scaled(10000);
+    constexpr int REPEATS = 50;
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "7200");
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        formulas.push_back(ParseFormula("A1*(1/3600)*24+(2*3-1)/4*-(-" + std::to_string(i % 100) +
+                                        ")+SUM(1,2,3)/(60*60)"));
+    }
+
+    double checksum = 0;
+    Report("constant_folding", "evaluate_ms", MeasureMs([&] {
+               for (int repeat = 0; repeat < REPEATS; ++repeat) {
+                   for (const auto& formula : formulas) {
+                       checksum += std::get<double>(formula->Evaluate(*sheet));
+                   }
+               }
+           }));
+    Report("constant_folding", "checksum", checksum);
+}
+
+// Формулы, ссылающиеся на ячейки с ошибками #ARITHM! и #VALUE!
+void BenchErrorPropagation() {
+    const int FORMULAS = Scaled(10000);
+    constexpr int REPEATS = 50;
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "=1/0");
+    sheet->SetCell({0, 1}, "not a number");
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        formulas.push_back(ParseFormula(i % 2 ? "A1*2+1" : "3-B1/2"));
+    }
+
+    size_t errors = 0;
+    Report("error_propagation", "evaluate_ms", MeasureMs([&] {
+               for (int repeat = 0; repeat < REPEATS; ++repeat) {
+                   for (const auto& formula : formulas) {
+                       errors += std::holds_alternative<FormulaError>(formula->Evaluate(*sheet));
+                   }
+               }
+           }));
+    Report("error_propagation", "errors", static_cast<double>(errors));
+}
+
+// Разбор большого числа типичных формул
+void BenchFormulaParse() {
+    const int FORMULAS = Scaled(100000);
+    std::vector<std::string> expressions;
+    expressions.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        Position lhs{i % Position::MAX_ROWS, i % 26};
+        Position rhs{(i * 7) % Position::MAX_ROWS, (i * 3) % 700};
+        expressions.push_back(lhs.ToString() + "+" + rhs.ToString() + "*3-(" +
+                              std::to_string(i) + ".5/" + lhs.ToString() + ")");
+    }
+
+    size_t cells = 0;
+    Report("formula_parse", "parse_ms", MeasureMs([&] {
+               for (const auto& expression : expressions) {
+                   cells += ParseFormula(expression)->GetReferencedCells().size();
+               }
+           }));
+    Report("formula_parse", "referenced_cells", static_cast<double>(cells));
+}
+
+Position ChainPosition(int index) {
+    return {index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+}
+
+// Длинная цепочка формул: правка первой ячейки и чтение последней
+void BenchLongChain() {
+    const int LENGTH = Scaled(50000);
+    constexpr int EDITS = 20;
+    Sheet sheet;
+
+    Report("long_chain", "build_ms", MeasureMs([&] {
+               for (int i = LENGTH - 1; i > 0; --i) {
+                   sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+               }
+               sheet.SetCell(ChainPosition(0), "0");
+           }));
+
+    Report("long_chain", "recalculate_ms", MeasureMs([&] {
+               sheet.Recalculate();
+           }));
+
+    double last = 0;
+    Report("long_chain", "edit_and_read_ms", MeasureMs([&] {
+               for (int edit = 1; edit <= EDITS; ++edit) {
+                   sheet.SetCell(ChainPosition(0), std::to_string(edit));
+                   last = std::get<double>(sheet.GetCell(ChainPosition(LENGTH - 1))->GetValue());
+               }
+           }));
+    Report("long_chain", "last_value", last);
+}
+
+// Числовая текстовая ячейка, на которую ссылаются тысячи формул
+void BenchTextInputs() {
+    const int FORMULAS = Scaled(10000);
+    constexpr int EDITS = 20;
+    Sheet sheet;
+    const Position input{0, 0};
+    for (int i = 0; i < FORMULAS; ++i) {
+        sheet.SetCell({1 + i % 1000, 1 + i / 1000}, "=A1*2+A1/" + std::to_string(i + 1));
+    }
+
+    Report("text_inputs", "recalculate_ms", MeasureMs([&] {
+               for (int edit = 0; edit < EDITS; ++edit) {
+                   sheet.SetCell(input, std::to_string(edit) + ".25");
+                   sheet.Recalculate();
+               }
+           }));
+}
+
+// Сумма столбца из 5000 чисел: длинная цепочка сложений против SUM по
+// диапазону
+void BenchRangeAggregate() {
+    constexpr int ROWS = 5000;
+    constexpr int REPEATS = 200;
+    Sheet sheet;
+    for (int row = 0; row < ROWS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row % 100) + ".5");
+    }
+
+    std::string chain = "=A1";
+    for (int row = 1; row < ROWS; ++row) {
+        chain += "+A" + std::to_string(row + 1);
+    }
+    const std::string range = "=SUM(A1:A" + std::to_string(ROWS) + ")";
+
+    for (const auto& [metric, text] : {std::pair{"chain", chain}, std::pair{"range", range}}) {
+        const Position target{0, 2};
+        Report("range_aggregate", std::string(metric) + "_set_ms", MeasureMs([&] {
+                   sheet.SetCell(target, text);
+               }));
+
+        double checksum = 0;
+        const auto* cell = sheet.GetCell(target);
+        Report("range_aggregate", std::string(metric) + "_evaluate_ms", MeasureMs([&] {
+                   for (int repeat = 0; repeat < REPEATS; ++repeat) {
+                       sheet.SetCell({0, 0}, std::to_string(repeat));
+                       checksum += std::get<double>(cell->GetValue());
+                   }
+               }));
+        Report("range_aggregate", std::string(metric) + "_checksum", checksum);
+    }
+}
+
+// Формулы над целым столбцом с редкими данными: создание формул, появление
+// новых чисел внутри диапазонов и пересчёт
+void BenchLargeRanges() {
+    constexpr int FORMULAS = 100;
+    constexpr int VALUES = 100;
+    const std::string column = "=SUM(A1:A" + std::to_string(Position::MAX_ROWS) + ")";
+    Sheet sheet;
+
+    Report("large_ranges", "set_ms", MeasureMs([&] {
+               for (int row = 0; row < FORMULAS; ++row) {
+                   sheet.SetCell({row, 2}, column + "+" + std::to_string(row));
+               }
+           }));
+
+    Report("large_ranges", "insert_value_us", MeasureMs([&] {
+               for (int i = 0; i < VALUES; ++i) {
+                   sheet.SetCell({i * (Position::MAX_ROWS / VALUES), 0}, std::to_string(i));
+               }
+           }) * 1000 / VALUES);
+
+    double checksum = 0;
+    Report("large_ranges", "evaluate_ms", MeasureMs([&] {
+               for (int row = 0; row < FORMULAS; ++row) {
+                   checksum += std::get<double>(sheet.GetCell({row, 2})->GetValue());
+               }
+           }));
+    Report("large_ranges", "checksum", checksum);
+}
+
+// Формулы над соседними столбцами на одних и тех же строках: поиск
+// покрывающих диапазонов не должен перебирать диапазоны других столбцов
+void BenchColumnRanges() {
+    constexpr int FORMULAS = 2000;
+    constexpr int ROWS = 1000;
+    constexpr int VALUES = 2000;
+    Sheet sheet;
+
+    Report("column_ranges", "set_ms", MeasureMs([&] {
+               for (int col = 0; col < FORMULAS; ++col) {
+                   const CellRange range{{0, col}, {ROWS - 1, col}};
+                   sheet.SetCell({ROWS, col}, "=SUM(" + range.ToString() + ")");
+               }
+           }));
+
+    Report("column_ranges", "insert_value_us", MeasureMs([&] {
+               for (int i = 0; i < VALUES; ++i) {
+                   sheet.SetCell({i % ROWS, i * 7 % FORMULAS}, std::to_string(i));
+               }
+           }) * 1000 / VALUES);
+
+    double checksum = 0;
+    Report("column_ranges", "evaluate_ms", MeasureMs([&] {
+               for (int col = 0; col < FORMULAS; ++col) {
+                   checksum += std::get<double>(sheet.GetCell({ROWS, col})->GetValue());
+               }
+           }));
+    Report("column_ranges", "checksum", checksum);
+}
+
+// Загрузка сетки формул по одной ячейке и пакетом; строки подаются снизу
+// вверх, то есть формулы появляются раньше ячеек, на которые ссылаются
+void BenchBulkLoad() {
+    const int ROWS = Scaled(300);
+    constexpr int COLS = 200;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(ROWS * COLS);
+    for (int row = ROWS - 1; row >= 0; --row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col < COLS; ++col) {
+            std::string text = "=" + Position{row, col - 1}.ToString() + "*0.5";
+            if (row > 0) {
+                text += "+" + Position{row - 1, col}.ToString();
+            }
+            cells.emplace_back(Position{row, col}, std::move(text));
+        }
+    }
+
+    double checksum = 0;
+    const Position last{ROWS - 1, COLS - 1};
+    {
+        Sheet sheet;
+        Report("bulk_load", "set_cell_ms", MeasureMs([&] {
+                   for (const auto& [pos, text] : cells) {
+                       sheet.SetCell(pos, text);
+                   }
+               }));
+        checksum += std::get<double>(sheet.GetCell(last)->GetValue());
+    }
+    {
+        Sheet sheet;
+        Report("bulk_load", "set_cells_ms", MeasureMs([&] {
+                   sheet.SetCells(cells);
+               }));
+        checksum += std::get<double>(sheet.GetCell(last)->GetValue());
+    }
+    Report("bulk_load", "checksum", checksum);
+}
+
+// Загрузка вывода PrintTexts из файла: скорость разбора на поля и полной
+// загрузки в лист
+void BenchTextImport() {
+    constexpr int ROWS = 4000;
+    constexpr int COLS = 100;
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string texts;
+    {
+        Sheet source;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                cells.emplace_back(Position{row, col},
+                                   col % 4 == 3 ? "=" + Position{row, col - 1}.ToString() + "*2"
+                                                : std::to_string(row * 0.25 + col));
+            }
+        }
+        source.SetCells(std::move(cells));
+        std::ostringstream output;
+        source.PrintTexts(output);
+        texts = output.str();
+    }
+    const double gigabytes = texts.size() / 1e9;
+
+    size_t tokens = 0;
+    const double tokenize_ms = MeasureMs([&] {
+        tokens = TokenizeTexts(texts, '\t', threads).size();
+    });
+    Report("text_import", "tokenize_gbps", gigabytes / (tokenize_ms / 1000));
+    Report("text_import", "tokens", static_cast<double>(tokens));
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_import.tsv";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << texts;
+    }
+    Sheet sheet;
+    sheet.SetRecalcThreadCount(threads);
+    const double import_ms = MeasureMs([&] {
+        ImportTextsFromFile(sheet, path.string(), '\t', threads);
+    });
+    std::filesystem::remove(path);
+    Report("text_import", "import_file_ms", import_ms);
+    Report("text_import", "import_gbps", gigabytes / (import_ms / 1000));
+}
+
+// Холодный старт: загрузка текстов с разбором и пересчётом формул против
+// загрузки двоичного образа с готовыми программами и значениями
+void BenchSnapshot() {
+    const int ROWS = Scaled(2000);
+    constexpr int COLS = 50;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col < COLS; ++col) {
+            std::string text = "=" + Position{row, col - 1}.ToString() + "*0.5+1";
+            if (row > 0) {
+                text += "+SUM(" + Position{row - 1, 0}.ToString() + ":" +
+                        Position{row - 1, col}.ToString() + ")/" + std::to_string(COLS);
+            }
+            cells.emplace_back(Position{row, col}, std::move(text));
+        }
+    }
+    const Position last{ROWS - 1, COLS - 1};
+
+    Sheet source;
+    double checksum = 0;
+    Report("snapshot", "parse_and_recalculate_ms", MeasureMs([&] {
+               source.SetCells(cells);
+               source.Recalculate();
+           }));
+    checksum += std::get<double>(source.GetCell(last)->GetValue());
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_snapshot.bin";
+    Report("snapshot", "save_ms", MeasureMs([&] {
+               BinarySnapshot::SaveToFile(source, path.string());
+           }));
+    Report("snapshot", "file_mb", std::filesystem::file_size(path) / 1e6);
+
+    std::unique_ptr<Sheet> loaded;
+    Report("snapshot", "load_ms", MeasureMs([&] {
+               loaded = BinarySnapshot::LoadFromFile(path.string());
+           }));
+    std::filesystem::remove(path);
+    Report("snapshot", "first_value_ms", MeasureMs([&] {
+               checksum += std::get<double>(loaded->GetCell(last)->GetValue());
+           }));
+    Report("snapshot", "checksum", checksum);
+}
+
+// Снимки для читателей: первый снимок большого листа и последующие после
+// точечных правок, которые разделяют с предыдущим почти все блоки
+void BenchSheetSnapshots() {
+    const int ROWS = Scaled(2000);
+    constexpr int COLS = 100;
+    constexpr int EDITS = 1000;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        for (int col = 1; col < COLS; ++col) {
+            cells.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "+1");
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    std::shared_ptr<const SheetSnapshot> snapshot;
+    Report("sheet_snapshots", "first_ms", MeasureMs([&] {
+               snapshot = sheet.TakeSnapshot();
+           }));
+
+    std::mt19937 random(42);
+    Report("sheet_snapshots", "edit_and_snapshot_us", MeasureMs([&] {
+               for (int edit = 0; edit < EDITS; ++edit) {
+                   const int row = static_cast<int>(random() % ROWS);
+                   sheet.SetCell({row, 0}, std::to_string(edit));
+                   snapshot = sheet.TakeSnapshot();
+               }
+           }) * 1000 / EDITS);
+    Report("sheet_snapshots", "checksum",
+           std::get<double>(snapshot->GetCell({ROWS - 1, COLS - 1})->value));
+}
+
+// Чтение значений из нескольких потоков: с актуальным кэшем (без
+// блокировок) и сразу после правки, когда первые читатели вычисляют формулы
+void BenchConcurrentReads() {
+    constexpr int ROWS = 200;
+    constexpr int COLS = 100;
+    constexpr int READS = 1000000;
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    Sheet sheet;
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            sheet.SetCell({row, col}, col == 0 ? std::to_string(row)
+                                               : "=" + Position{row, col - 1}.ToString() + "+1");
+        }
+    }
+
+    auto read_all = [&](size_t threads) {
+        std::vector<std::thread> readers;
+        std::atomic<double> checksum = 0;
+        for (size_t thread = 0; thread < threads; ++thread) {
+            readers.emplace_back([&, thread] {
+                std::mt19937 random(static_cast<unsigned>(thread));
+                double sum = 0;
+                for (size_t read = 0; read < READS / threads; ++read) {
+                    const Position pos{static_cast<int>(random() % ROWS),
+                                       1 + static_cast<int>(random() % (COLS - 1))};
+                    sum += std::get<double>(sheet.GetCell(pos)->GetValue());
+                }
+                checksum = checksum + sum;
+            });
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        return checksum.load();
+    };
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        const std::string scenario = "concurrent_reads_" + std::to_string(threads) + "t";
+        sheet.SetCell({0, 0}, "1");
+        Report(scenario, "cold_mreads_per_s", READS / MeasureMs([&] {
+                                                  read_all(threads);
+                                              }) / 1000);
+        Report(scenario, "warm_mreads_per_s", READS / MeasureMs([&] {
+                                                  read_all(threads);
+                                              }) / 1000);
+    }
+}
+
+// Выделения и занятая память на ячейку и время уничтожения листа: числа,
+// тексты и формулы со ссылками на соседей
+void BenchAllocations() {
+    constexpr int ROWS = 1000;
+    constexpr int COLS = 20;
+    constexpr double CELLS = ROWS * COLS;
+
+    auto fill = [&](Sheet& sheet, auto make_text) {
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                sheet.SetCell({row, col}, make_text(row, col));
+            }
+        }
+    };
+    auto run = [&](const std::string& scenario, auto make_text) {
+        const size_t bytes_before = heap_bytes.load();
+        auto sheet = std::make_unique<Sheet>();
+        const size_t before = heap_allocations.load();
+        fill(*sheet, make_text);
+        Report(scenario, "allocations_per_cell", (heap_allocations.load() - before) / CELLS);
+        Report(scenario, "bytes_per_cell",
+               (heap_bytes.load() - bytes_before + sizeof(Sheet)) / CELLS);
+        Report(scenario, "teardown_ms", MeasureMs([&] {
+                   sheet.reset();
+               }));
+    };
+
+    run("allocations_numbers", [](int row, int col) {
+        return std::to_string(row * COLS + col);
+    });
+    run("allocations_texts", [](int row, int col) {
+        return "item number " + std::to_string(row * COLS + col);
+    });
+    run("allocations_formulas", [](int row, int col) {
+        if (row == 0) {
+            return std::to_string(col);
+        }
+        return "=" + Position{row - 1, col}.ToString() + "+" +
+               Position{row - 1, (col + 1) % COLS}.ToString() + "*2";
+    });
+}
+
+// Рёбра графа: широкое разветвление от одной ячейки (сброс кэшей обходит
+// всех зависимых) и перенос формул между источниками (удаление рёбер из
+// длинного списка зависимых)
+void BenchFanEdges() {
+    const int FORMULAS = Scaled(100000);
+    constexpr int EDITS = 20;
+    constexpr int REPOINTS = 20000;
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    sheet.SetCell({1, 0}, "2");
+    auto formula_pos = [](int i) {
+        return Position{i % 1000, 1 + i / 1000};
+    };
+
+    Report("fan_edges", "build_ms", MeasureMs([&] {
+               for (int i = 0; i < FORMULAS; ++i) {
+                   sheet.SetCell(formula_pos(i), i % 2 ? "=A1+A2" : "=A1*2");
+               }
+           }));
+    Report("fan_edges", "invalidate_us", MeasureMs([&] {
+                                             for (int edit = 0; edit < EDITS; ++edit) {
+                                                 sheet.SetCell({0, 0}, std::to_string(edit));
+                                                 sheet.GetCell(formula_pos(0))->GetValue();
+                                             }
+                                         }) * 1000 / EDITS);
+    sheet.Recalculate();
+    std::mt19937 random(1);
+    Report("fan_edges", "repoint_us", MeasureMs([&] {
+                                          for (int i = 0; i < REPOINTS; ++i) {
+                                              sheet.SetCell(formula_pos(random() % FORMULAS),
+                                                            i % 2 ? "=A2*3" : "=A1-A2");
+                                          }
+                                      }) * 1000 / REPOINTS);
+    double checksum = 0;
+    Report("fan_edges", "recalculate_ms", MeasureMs([&] {
+               sheet.SetCell({0, 0}, "5");
+               sheet.Recalculate();
+           }));
+    for (int i = 0; i < FORMULAS; i += 97) {
+        checksum += std::get<double>(sheet.GetCell(formula_pos(i))->GetValue());
+    }
+    Report("fan_edges", "checksum", checksum);
+}
+
+// Поиск позиций в множестве на плотной, диагональной и разреженной
+// раскладках: половина запросов попадает, половина нет. Сравниваются
+// std::unordered_set с прежним хешем (row ^ col << 1), он же с хешем
+// упакованного ключа, PositionsSet и поиск ячейки в листе.
+void BenchPositionLookup() {
+    constexpr int COUNT = 16384;
+    constexpr int LOOKUPS = 4000000;
+
+    struct LegacyHasher {
+        size_t operator()(Position pos) const {
+            return std::hash<int>()(pos.row) ^ (std::hash<int>()(pos.col) << 1);
+        }
+    };
+
+    std::mt19937 random(7);
+    const std::vector<std::pair<std::string, std::function<Position(int)>>> layouts = {
+        {"dense", [](int i) { return Position{i / 128, i % 128}; }},
+        {"diagonal", [](int i) { return Position{i, i}; }},
+        {"sparse", [&](int) {
+             return Position{static_cast<int>(random() % Position::MAX_ROWS),
+                             static_cast<int>(random() % Position::MAX_COLS)};
+         }},
+    };
+
+    for (const auto& [layout, make_position] : layouts) {
+        std::vector<Position> stored;
+        for (int i = 0; i < COUNT; ++i) {
+            stored.push_back(make_position(i));
+        }
+        const std::unordered_set<Position, LegacyHasher> legacy(stored.begin(), stored.end());
+        // Промахи — случайные позиции листа, которых нет среди сохранённых
+        std::vector<Position> queries;
+        for (int i = 0; i < COUNT; ++i) {
+            queries.push_back(stored[random() % COUNT]);
+            Position miss;
+            do {
+                miss = {static_cast<int>(random() % Position::MAX_ROWS),
+                        static_cast<int>(random() % Position::MAX_COLS)};
+            } while (legacy.count(miss));
+            queries.push_back(miss);
+        }
+        std::shuffle(queries.begin(), queries.end(), random);
+
+        auto measure = [&](const std::string& metric, auto&& contains) {
+            size_t found = 0;
+            const double ms = MeasureMs([&] {
+                for (int i = 0; i < LOOKUPS; ++i) {
+                    found += contains(queries[i % queries.size()]);
+                }
+            });
+            Report("position_lookup_" + layout, metric + "_mlookups_s", LOOKUPS / ms / 1000);
+            Report("position_lookup_" + layout, metric + "_found", static_cast<double>(found));
+        };
+
+        measure("unordered_legacy", [&](Position pos) { return legacy.count(pos); });
+        const std::unordered_set<Position, PositionHasher> hashed(stored.begin(), stored.end());
+        measure("unordered_packed", [&](Position pos) { return hashed.count(pos); });
+        const PositionsSet flat(stored.begin(), stored.end());
+        measure("positions_set", [&](Position pos) { return flat.count(pos); });
+
+        Sheet sheet;
+        for (const Position& pos : stored) {
+            sheet.SetCell(pos, "x");
+        }
+        measure("sheet_get_cell", [&](Position pos) { return sheet.GetCell(pos) ? 1u : 0u; });
+    }
+}
+
+// Сведение многих ячеек в одну формулу: разбор и создание рёбер, затем
+// правки входов с чтением итога
+void BenchFanIn() {
+    const int INPUTS = Scaled(2000);
+    constexpr int EDITS = 1000;
+    Sheet sheet;
+    std::string sum = "=A1";
+    for (int row = 0; row < INPUTS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row % 10));
+        if (row > 0) {
+            sum += "+A" + std::to_string(row + 1);
+        }
+    }
+
+    const Position target{0, 1};
+    Report("fan_in", "set_ms", MeasureMs([&] {
+               sheet.SetCell(target, sum);
+           }));
+    double checksum = 0;
+    const auto* cell = sheet.GetCell(target);
+    std::mt19937 random(5);
+    Report("fan_in", "edit_and_read_us", MeasureMs([&] {
+                                             for (int edit = 0; edit < EDITS; ++edit) {
+                                                 sheet.SetCell({static_cast<int>(random() % INPUTS), 0},
+                                                               std::to_string(edit % 10));
+                                                 checksum += std::get<double>(cell->GetValue());
+                                             }
+                                         }) * 1000 / EDITS);
+    Report("fan_in", "checksum", checksum);
+}
+
+// Печать большого листа из чисел, текстов, формул и ошибок: первая печать
+// вычисляет формулы, повторная берёт значения из кэша
+void BenchPrintValues() {
+    const int ROWS = Scaled(2000);
+    constexpr int COLS = 50;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            std::string text;
+            if (col == 0) {
+                text = std::to_string(row);
+            } else if (col % 10 == 1) {
+                text = "label " + std::to_string(row);
+            } else if (col % 10 == 7) {
+                text = "=" + Position{row, col - 1}.ToString() + "/" + Position{row, 0}.ToString();
+            } else {
+                text = "=" + Position{row, col - 1}.ToString() + "*2+1";
+            }
+            cells.emplace_back(Position{row, col}, std::move(text));
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    std::ostringstream values;
+    Report("print_values", "cold_ms", MeasureMs([&] {
+               sheet.PrintValues(values);
+           }));
+    std::ostringstream warm;
+    Report("print_values", "warm_ms", MeasureMs([&] {
+               sheet.PrintValues(warm);
+           }));
+    std::ostringstream texts;
+    Report("print_values", "print_texts_ms", MeasureMs([&] {
+               sheet.PrintTexts(texts);
+           }));
+    Report("print_values", "output_mb", values.str().size() / 1e6);
+}
+
+// Задержка правок в длинной цепочке: переписывание последней формулы,
+// средней формулы и замыкание цепочки (отвергаемый цикл)
+void BenchChainEdit() {
+    const int LENGTH = Scaled(100000);
+    constexpr int EDITS = 200;
+    Sheet sheet;
+    for (int i = 1; i < LENGTH; ++i) {
+        sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+    }
+    sheet.SetCell(ChainPosition(0), "0");
+
+    const Position last = ChainPosition(LENGTH - 1);
+    const Position prev = ChainPosition(LENGTH - 2);
+    Report("chain_edit", "edit_last_us", MeasureMs([&] {
+               for (int edit = 0; edit < EDITS; ++edit) {
+                   sheet.SetCell(last, "=" + prev.ToString() + "+" + std::to_string(edit));
+               }
+           }) * 1000 / EDITS);
+
+    const Position middle = ChainPosition(LENGTH / 2);
+    const Position before_middle = ChainPosition(LENGTH / 2 - 1);
+    Report("chain_edit", "edit_middle_us", MeasureMs([&] {
+               for (int edit = 0; edit < EDITS; ++edit) {
+                   sheet.SetCell(middle, "=" + before_middle.ToString() + "*" + std::to_string(edit));
+               }
+           }) * 1000 / EDITS);
+
+    size_t rejected = 0;
+    const Position first = ChainPosition(0);
+    Report("chain_edit", "reject_cycle_us", MeasureMs([&] {
+               for (int edit = 0; edit < EDITS; ++edit) {
+                   try {
+                       sheet.SetCell(first, "=" + last.ToString());
+                   } catch (const CircularDependencyException&) {
+                       ++rejected;
+                   }
+               }
+           }) * 1000 / EDITS);
+    Report("chain_edit", "rejected", static_cast<double>(rejected));
+}
+
+// Пересчёт широкой сетки формул после правки первой строки при разном
+// числе потоков
+void BenchParallelRecalc() {
+    const int ROWS = Scaled(50);
+    constexpr int COLS = 200;
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    for (size_t threads : thread_counts) {
+        Sheet sheet;
+        sheet.SetRecalcThreadCount(threads);
+        for (int row = 1; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                Position up{row - 1, col};
+                Position up_left{row - 1, (col + COLS - 1) % COLS};
+                sheet.SetCell({row, col}, "=" + up.ToString() + "*0.5+" + up_left.ToString() + "/4+1");
+            }
+        }
+
+        const std::string scenario = "parallel_recalc_" + std::to_string(threads) + "t";
+        Report(scenario, "recalculate_ms", MeasureMs([&] {
+                   for (int edit = 0; edit < 5; ++edit) {
+                       for (int col = 0; col < COLS; ++col) {
+                           sheet.SetCell({0, col}, std::to_string(edit + col));
+                       }
+                       sheet.Recalculate();
+                   }
+               }));
+    }
+}
+
+void WriteResults(std::ostream& out) {
+    if (options.format == "json") {
+        out << "{\n  \"scale\": " << FormatValue(options.scale, true)
+            << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency()
+            << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            out << (i ? ",\n" : "\n") << "    {\"scenario\": " << Quote(results[i].scenario)
+                << ", \"metric\": " << Quote(results[i].metric)
+                << ", \"value\": " << FormatValue(results[i].value, true) << '}';
+        }
+        out << "\n  ]\n}\n";
+    } else if (options.format == "csv") {
+        out << "scenario,metric,value\n";
+        for (const auto& result : results) {
+            out << result.scenario << ',' << result.metric << ','
+                << FormatValue(result.value, false) << '\n';
+        }
+    } else {
+        for (const auto& result : results) {
+            out << result.scenario << '\t' << result.metric << '\t'
+                << FormatValue(result.value, false) << '\n';
+        }
+    }
+}
+
+// --format=tsv|csv|json, --output=<файл>, --scale=<множитель>, --list,
+// --trace=<файл> (сборка с SPREADSHEET_TRACE); остальные аргументы —
+// имена сценариев
+bool ParseOptions(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&](const std::string& name) -> std::optional<std::string> {
+            if (arg.rfind(name + "=", 0) == 0) {
+                return arg.substr(name.size() + 1);
+            }
+            return std::nullopt;
+        };
+        if (auto format = value("--format")) {
+            options.format = *format;
+            if (options.format != "tsv" && options.format != "csv" && options.format != "json") {
+                std::cerr << "unknown format " << options.format << '\n';
+                return false;
+            }
+        } else if (auto output = value("--output")) {
+            options.output = *output;
+        } else if (auto scale = value("--scale")) {
+            char* end = nullptr;
+            options.scale = std::strtod(scale->c_str(), &end);
+            if (scale->empty() || *end != '\0' || !(options.scale > 0)) {
+                std::cerr << "invalid scale " << *scale << '\n';
+                return false;
+            }
+        } else if (auto trace = value("--trace")) {
+            if (!Trace::ENABLED) {
+                std::cerr << "--trace requires a build with SPREADSHEET_TRACE\n";
+                return false;
+            }
+            options.trace = *trace;
+        } else if (arg == "--list") {
+            options.list = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "unknown option " << arg << '\n';
+            return false;
+        } else {
+            options.scenarios.push_back(arg);
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const std::vector<Scenario> scenarios = {
+        {"dense_sheet", BenchDenseSheet},
+        {"sparse_sheet", BenchSparseSheet},
+        {"formula_evaluate", BenchFormulaEvaluate},
+        {"constant_folding", BenchConstantFolding},
+        {"error_propagation", BenchErrorPropagation},
+        {"formula_parse", BenchFormulaParse},
+        {"long_chain", BenchLongChain},
+        {"text_inputs", BenchTextInputs},
+        {"range_aggregate", BenchRangeAggregate},
+        {"large_ranges", BenchLargeRanges},
+        {"column_ranges", BenchColumnRanges},
+        {"bulk_load", BenchBulkLoad},
+        {"text_import", BenchTextImport},
+        {"snapshot", BenchSnapshot},
+        {"sheet_snapshots", BenchSheetSnapshots},
+        {"concurrent_reads", BenchConcurrentReads},
+        {"allocations", BenchAllocations},
+        {"fan_edges", BenchFanEdges},
+        {"fan_in", BenchFanIn},
+        {"print_values", BenchPrintValues},
+        {"position_lookup", BenchPositionLookup},
+        {"chain_edit", BenchChainEdit},
+        {"parallel_recalc", BenchParallelRecalc},
+    };
+
+    if (!ParseOptions(argc, argv)) {
+        return 2;
+    }
+    if (options.list) {
+        for (const auto& scenario : scenarios) {
+            std::cout << scenario.name << '\n';
+        }
+        return 0;
+    }
+    for (const auto& name : options.scenarios) {
+        const bool known = std::any_of(scenarios.begin(), scenarios.end(), [&](const Scenario& scenario) {
+            return scenario.name == name;
+        });
+        if (!known) {
+            std::cerr << "unknown scenario " << name << '\n';
+            return 2;
+        }
+    }
+
+    // Буфер трассы хранит последние Trace::CAPACITY событий прогона
+    if (!options.trace.empty()) {
+        Trace::Start();
+    }
+    for (const auto& scenario : scenarios) {
+        const bool enabled =
+            options.scenarios.empty() ||
+            std::find(options.scenarios.begin(), options.scenarios.end(), scenario.name) != options.scenarios.end();
+        if (enabled) {
+            scenario.run();
+        }
+    }
+
+    if (!options.trace.empty()) {
+        Trace::Stop();
+        Trace::SaveChromeJson(options.trace);
+    }
+
+    if (!options.output.empty()) {
+        std::ofstream file(options.output);
+        WriteResults(file);
+        if (!file) {
+            std::cerr << "cannot write " << options.output << '\n';
+            return 1;
+        }
+    } else if (options.format != "tsv") {
+        WriteResults(std::cout);
+    }
+}
@@ -0,0 +1,340 @@
+#include "binary_snapshot.h"
+
+#include "FormulaAST.h"
+#include "mapped_file.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr char MAGIC[8] = {'S', 'P', 'S', 'H', 'E', 'E', 'T', '\0'};
+// Записывается как есть: при другом порядке байт прочитается иначе
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+enum class CellKind : uint8_t { Empty, Text, Formula };
+enum class CacheKind : uint8_t { None, Number, Error };
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t cell_count;
+  uint64_t instruction_count;
+  uint64_t text_size;
+};
+
+struct CellRecord {
+  int32_t row;
+  int32_t col;
+  int64_t order;
+  uint8_t kind;
+  uint8_t cache_kind;
+  uint8_t error_category;
+  uint8_t reserved;
+  uint32_t length; // текст — байты, формула — инструкции
+  uint64_t offset; // начало в разделе текстов или инструкций
+  double cache_value;
+};
+
+// Позиции — row и col подряд (для диапазона две позиции), аргументы
+// агрегатной функции — scalars и ranges
+struct InstructionRecord {
+  uint8_t op;
+  uint8_t reserved[3];
+  int32_t values[4];
+  uint32_t reserved2;
+  double number;
+};
+
+// Размеры и выравнивание записей — часть формата
+static_assert(sizeof(Header) == 40);
+static_assert(sizeof(CellRecord) == 40);
+static_assert(sizeof(InstructionRecord) == 32);
+
+[[noreturn]] void Fail(const std::string &what) {
+  throw std::runtime_error("BinarySnapshot: " + what);
+}
+
+InstructionRecord ToRecord(const ASTImpl::Instruction &instruction) {
+  using ASTImpl::OpCode;
+  InstructionRecord record{};
+  record.op = static_cast<uint8_t>(instruction.op);
+  if (instruction.op == OpCode::Number) {
+    record.number = instruction.number;
+  } else if (instruction.op == OpCode::Cell) {
+    record.values[0] = instruction.cell.row;
+    record.values[1] = instruction.cell.col;
+  } else if (instruction.op == OpCode::Range) {
+    record.values[0] = instruction.range.first.row;
+    record.values[1] = instruction.range.first.col;
+    record.values[2] = instruction.range.last.row;
+    record.values[3] = instruction.range.last.col;
+  } else if (ASTImpl::IsAggregate(instruction.op)) {
+    record.values[0] = instruction.arguments.scalars;
+    record.values[1] = instruction.arguments.ranges;
+  }
+  return record;
+}
+
+ASTImpl::Instruction FromRecord(const InstructionRecord &record) {
+  using ASTImpl::Instruction;
+  using ASTImpl::OpCode;
+  const auto op = static_cast<OpCode>(record.op);
+  const int32_t *values = record.values;
+  if (op == OpCode::Number) {
+    return Instruction(op, record.number);
+  } else if (op == OpCode::Cell) {
+    Position cell{values[0], values[1]};
+    if (!cell.IsValid()) {
+      Fail("invalid cell in formula");
+    }
+    return Instruction(cell);
+  } else if (op == OpCode::Range) {
+    CellRange range{{values[0], values[1]}, {values[2], values[3]}};
+    if (!range.IsValid()) {
+      Fail("invalid range in formula");
+    }
+    return Instruction(range);
+  } else if (ASTImpl::IsAggregate(op)) {
+    constexpr int32_t MAX_ARGUMENTS = std::numeric_limits<uint16_t>::max();
+    if (values[0] < 0 || values[0] > MAX_ARGUMENTS || values[1] < 0 ||
+        values[1] > MAX_ARGUMENTS) {
+      Fail("invalid function arguments");
+    }
+    return Instruction(op, ASTImpl::Arguments{static_cast<uint16_t>(values[0]),
+                                              static_cast<uint16_t>(values[1])});
+  }
+  // Неизвестный код отвергнет проверка программы в LoadFormula
+  return Instruction(op);
+}
+
+template <typename T> void Write(std::ostream &output, const std::vector<T> &items) {
+  output.write(reinterpret_cast<const char *>(items.data()),
+               static_cast<std::streamsize>(items.size() * sizeof(T)));
+}
+
+// Записи читаются копированием: данные отображённого файла не обязаны быть
+// выровнены под тип записи
+template <typename T> T Read(const char *data, uint64_t index) {
+  T record;
+  std::memcpy(&record, data + index * sizeof(T), sizeof(T));
+  return record;
+}
+
+} // namespace
+
+void BinarySnapshot::Save(Sheet &sheet, std::ostream &output) {
+  sheet.Recalculate();
+
+  std::vector<CellRecord> cells;
+  std::vector<InstructionRecord> instructions;
+  std::string texts;
+  cells.reserve(sheet.cells_.Size());
+  sheet.cells_.ForEach([&](Position pos, const Cell &cell) {
+    CellRecord record{};
+    record.row = pos.row;
+    record.col = pos.col;
+    record.order = cell.order_;
+    if (const FormulaInterface *formula = cell.content_.GetFormula()) {
+      const auto &program = formula->GetProgram();
+      record.kind = static_cast<uint8_t>(CellKind::Formula);
+      record.offset = instructions.size();
+      record.length = static_cast<uint32_t>(program.size());
+      for (const auto &instruction : program) {
+        instructions.push_back(ToRecord(instruction));
+      }
+      if (auto cache = cell.content_.GetCache()) {
+        if (const auto *number = std::get_if<double>(&*cache)) {
+          record.cache_kind = static_cast<uint8_t>(CacheKind::Number);
+          record.cache_value = *number;
+        } else {
+          record.cache_kind = static_cast<uint8_t>(CacheKind::Error);
+          record.error_category = static_cast<uint8_t>(
+              std::get<FormulaError>(*cache).GetCategory());
+        }
+      }
+    } else if (cell.IsEmpty()) {
+      // Пустые ячейки хранятся ради их места в топологическом порядке
+      record.kind = static_cast<uint8_t>(CellKind::Empty);
+    } else {
+      const std::string text = cell.GetText();
+      record.kind = static_cast<uint8_t>(CellKind::Text);
+      record.offset = texts.size();
+      record.length = static_cast<uint32_t>(text.size());
+      texts += text;
+    }
+    cells.push_back(record);
+  });
+
+  Header header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.byte_order = BYTE_ORDER_MARK;
+  header.cell_count = cells.size();
+  header.instruction_count = instructions.size();
+  header.text_size = texts.size();
+
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  Write(output, cells);
+  Write(output, instructions);
+  output.write(texts.data(), static_cast<std::streamsize>(texts.size()));
+  if (!output) {
+    Fail("write failed");
+  }
+}
+
+void BinarySnapshot::SaveToFile(Sheet &sheet, const std::string &path) {
+  std::ofstream output(path, std::ios::binary);
+  if (!output) {
+    Fail("cannot open " + path);
+  }
+  Save(sheet, output);
+}
+
+std::unique_ptr<Sheet> BinarySnapshot::Load(std::string_view data) {
+  Header header;
+  if (data.size() < sizeof(header)) {
+    Fail("truncated header");
+  }
+  std::memcpy(&header, data.data(), sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    Fail("not a sheet snapshot");
+  }
+  if (header.byte_order != BYTE_ORDER_MARK) {
+    Fail("byte order mismatch");
+  }
+  if (header.version != VERSION) {
+    Fail("unsupported version " + std::to_string(header.version));
+  }
+
+  // Размеры разделов проверяются делением, чтобы не переполнить умножение
+  uint64_t available = data.size() - sizeof(header);
+  if (header.cell_count > available / sizeof(CellRecord)) {
+    Fail("truncated cells");
+  }
+  available -= header.cell_count * sizeof(CellRecord);
+  if (header.instruction_count > available / sizeof(InstructionRecord)) {
+    Fail("truncated formulas");
+  }
+  available -= header.instruction_count * sizeof(InstructionRecord);
+  if (header.text_size != available) {
+    Fail("truncated texts");
+  }
+  const char *cell_data = data.data() + sizeof(header);
+  const char *instruction_data =
+      cell_data + header.cell_count * sizeof(CellRecord);
+  const std::string_view texts(
+      instruction_data + header.instruction_count * sizeof(InstructionRecord),
+      header.text_size);
+
+  auto sheet = std::make_unique<Sheet>();
+  std::vector<Cell *> formulas;
+  std::vector<int64_t> orders;
+  orders.reserve(header.cell_count);
+  int64_t first_order = 0;
+  int64_t last_order = 0;
+  for (uint64_t i = 0; i < header.cell_count; ++i) {
+    const auto record = Read<CellRecord>(cell_data, i);
+    const Position pos{record.row, record.col};
+    if (!pos.IsValid() || sheet->cells_.Find(pos)) {
+      Fail("invalid or repeated cell position");
+    }
+    Cell &cell = sheet->cells_.Emplace(pos, *sheet, pos, record.order);
+    orders.push_back(record.order);
+    first_order = std::min(first_order, record.order);
+    last_order = std::max(last_order, record.order);
+
+    switch (static_cast<CellKind>(record.kind)) {
+    case CellKind::Empty:
+      break;
+    case CellKind::Text: {
+      if (record.length == 0 || record.offset > texts.size() ||
+          record.length > texts.size() - record.offset) {
+        Fail("invalid text");
+      }
+      std::string text(texts.substr(record.offset, record.length));
+      // Такой текст разобрался бы как формула
+      if (text.size() > 1 && text.front() == FORMULA_SIGN) {
+        Fail("invalid text");
+      }
+      cell.content_ = Cell::Content(std::move(text), sheet->GetMemoryResource());
+      break;
+    }
+    case CellKind::Formula: {
+      if (record.offset > header.instruction_count ||
+          record.length > header.instruction_count - record.offset) {
+        Fail("invalid formula");
+      }
+      ASTImpl::Program program(sheet->GetMemoryResource());
+      program.reserve(record.length);
+      for (uint32_t j = 0; j < record.length; ++j) {
+        program.push_back(FromRecord(
+            Read<InstructionRecord>(instruction_data, record.offset + j)));
+      }
+
+      std::optional<FormulaInterface::Value> cache;
+      if (record.cache_kind == static_cast<uint8_t>(CacheKind::Number)) {
+        cache = record.cache_value;
+      } else if (record.cache_kind == static_cast<uint8_t>(CacheKind::Error)) {
+        if (record.error_category >
+            static_cast<uint8_t>(FormulaError::Category::Arithmetic)) {
+          Fail("invalid cached error");
+        }
+        cache = FormulaError(
+            static_cast<FormulaError::Category>(record.error_category));
+      }
+
+      try {
+        cell.content_ =
+            Cell::Content(LoadFormula(std::move(program)),
+                          sheet->GetMemoryResource(), cache);
+      } catch (const FormulaException &) {
+        Fail("malformed formula");
+      }
+      formulas.push_back(&cell);
+      break;
+    }
+    default:
+      Fail("unknown cell kind");
+    }
+    sheet->UpdatePrintableArea(pos, true, cell.IsEmpty());
+  }
+  sheet->first_order_ = first_order;
+  sheet->last_order_ = last_order;
+
+  // Перестановка Pearce–Kelly считает порядок строгим. Номера могут быть
+  // отрицательными и идти с пропусками, поэтому повторы ищутся сортировкой.
+  std::sort(orders.begin(), orders.end());
+  if (std::adjacent_find(orders.begin(), orders.end()) != orders.end()) {
+    Fail("repeated cell order");
+  }
+
+  // Порядок сохранён вместе с листом, поэтому рёбрам достаточно проверки,
+  // что каждая ссылка стоит раньше формулы: тогда циклов нет
+  for (Cell *cell : formulas) {
+    cell->NewReference(cell->content_.GetReferencedCells(),
+                       cell->content_.GetReferencedRanges());
+  }
+  for (const Cell *cell : formulas) {
+    bool ordered = true;
+    cell->ForEachReferenced([&](const Cell *reference) {
+      ordered = ordered && reference->order_ < cell->order_;
+    });
+    if (!ordered) {
+      Fail("inconsistent dependency order");
+    }
+  }
+  return sheet;
+}
+
+std::unique_ptr<Sheet> BinarySnapshot::LoadFromFile(const std::string &path) {
+  MappedFile file(path);
+  return Load(file.GetData());
+}
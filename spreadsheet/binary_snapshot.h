@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+
+class Sheet;
+
+// Двоичный образ листа для быстрого запуска. Хранит тексты, скомпилированные
+// программы формул, топологический порядок ячеек и вычисленные значения,
+// поэтому загрузка не разбирает и не вычисляет формулы: записи читаются
+// прямо из отображённого в память файла, а рёбра графа восстанавливаются по
+// ссылкам программ без проверки циклов.
+//
+// Формат: заголовок, массив записей ячеек фиксированного размера, массив
+// инструкций всех формул и тексты подряд. Числа записываются в порядке байт
+// машины; образ с другим порядком байт или версией не загружается.
+class BinarySnapshot {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    // Пересчитывает устаревшие формулы, чтобы образ был «тёплым», и
+    // записывает лист в output
+    static void Save(Sheet& sheet, std::ostream& output);
+    static void SaveToFile(Sheet& sheet, const std::string& path);
+
+    // Восстанавливает лист. Повреждённый или несовместимый образ —
+    // std::runtime_error.
+    static std::unique_ptr<Sheet> Load(std::string_view data);
+    static std::unique_ptr<Sheet> LoadFromFile(const std::string& path);
+};
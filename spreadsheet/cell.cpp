@@ -1,173 +1,536 @@
 #include "cell.h"
 #include "sheet.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <system_error>
+
+Cell::Cell(Sheet &sheet, Position position, int64_t order)
+    : sheet_(sheet), position_(position), order_(order) {}
+
+Cell::~Cell() {
+  if (links_) {
+    links_->~Links();
+    sheet_.GetMemoryResource()->deallocate(links_, sizeof(Links),
+                                           alignof(Links));
+  }
+}
 
-Cell::Cell(Sheet &sheet, Position position)
-    : sheet_(sheet), impl_(std::make_unique<EmptyImpl>()), position_(position) {
+Cell::Links &Cell::GetLinks() {
+  if (!links_) {
+    std::pmr::memory_resource *resource = sheet_.GetMemoryResource();
+    links_ = new (resource->allocate(sizeof(Links), alignof(Links)))
+        Links(resource);
+  }
+  return *links_;
 }
 
 void Cell::Set(std::string text) {
-  std::unique_ptr<Impl> temp_impl;
-
-  if (text.empty()) {
-    temp_impl = std::make_unique<EmptyImpl>();
-  } else if (text.size() > 1 && text.at(0) == FORMULA_SIGN) {
-    temp_impl = std::make_unique<FormulaImpl>(std::move(text), sheet_);
-  } else {
-    temp_impl = std::make_unique<TextImpl>(std::move(text));
+  Trace::Scope trace("Cell::Set", position_);
+  SheetStatsCounters &stats = sheet_.GetStatsCounters();
+  stats.Add(SheetStatsCounters::PARSED_TEXTS);
+  Content temp_content = [&] {
+    Trace::Scope trace("Parse", position_);
+    SheetStatsCounters::Timer timer(stats, SheetStatsCounters::PARSE_NS);
+    return Content(std::move(text), sheet_.GetMemoryResource());
+  }();
+
+  auto new_references = temp_content.GetReferencedCells();
+  auto new_ranges = temp_content.GetReferencedRanges();
+  bool cyclic;
+  {
+    SheetStatsCounters::Timer timer(stats, SheetStatsCounters::CYCLE_CHECK_NS);
+    cyclic = CircularDependency(new_references, new_ranges);
   }
-
-  if (CircularDependency(temp_impl)) {
+  stats.Add(SheetStatsCounters::CYCLE_CHECKS);
+  if (cyclic) {
+    stats.Add(SheetStatsCounters::REJECTED_CYCLES);
     throw CircularDependencyException("Cyclic dependency detected");
   }
 
-  NewReference(temp_impl->GetReferencedCells());
+  NewReference(new_references, new_ranges);
+  RestoreTopologicalOrder();
   InvalidCache();
 
-  impl_ = std::move(temp_impl);
+  content_ = std::move(temp_content);
 }
 
-void Cell::NewReference(const std::vector<Position> &new_dependents) {
-  for (Cell *cell : dependent_cells_) {
-    if (!cell) {
-      continue;
-    }
+void Cell::NewReference(const std::vector<Position> &new_references,
+                        const std::vector<CellRange> &new_ranges) {
+  Trace::Scope trace("Cell::NewReference", position_);
+  if (!links_ && new_references.empty() && new_ranges.empty()) {
+    return;
+  }
+  Links &links = GetLinks();
+  for (const Reference &reference : links.referenced_cells) {
+    reference.cell->RemoveDependent(reference.dependent_index);
+  }
+  for (const CellRange &range : links.referenced_ranges) {
+    sheet_.RemoveRangeDependency(range, this);
+  }
 
-    cell->dependent_cells_.erase(this);
+  links.referenced_cells.Clear();
+  for (auto &&pos : new_references) {
+    // Несуществующие ячейки создаются пустыми, чтобы при их изменении
+    // было кого оповестить
+    Cell *cell = sheet_.GetOrCreateCell(pos);
+    auto &dependents = cell->GetLinks().dependent_cells;
+    links.referenced_cells.PushBack(
+        {cell, static_cast<uint32_t>(dependents.Size())});
+    dependents.PushBack(this);
   }
 
-  referenced_cells_.clear();
-  if (!new_dependents.empty()) {
-    for (auto &&pos : new_dependents) {
-      Cell *cell = sheet_.GetConcreteCell(pos);
-      if (cell == nullptr) {
-        sheet_.SetCell(pos, "");
-      }
-      referenced_cells_.insert(cell);
-    }
+  // Ячейки диапазонов не создаются: новая ячейка найдёт формулу по индексу
+  links.referenced_ranges.assign(new_ranges.begin(), new_ranges.end());
+  for (const CellRange &range : links.referenced_ranges) {
+    sheet_.AddRangeDependency(range, this);
   }
+}
 
-  for (Cell *cell : referenced_cells_) {
-    if (!cell) {
-      continue;
+void Cell::RemoveDependent(uint32_t index) {
+  auto &dependents = links_->dependent_cells;
+  Cell *moved = dependents.Back();
+  dependents.SwapRemove(index);
+  if (index == dependents.Size()) {
+    return;
+  }
+  for (Reference &reference : moved->links_->referenced_cells) {
+    if (reference.cell == this) {
+      reference.dependent_index = index;
+      return;
     }
-
-    dependent_cells_.insert(cell);
   }
 }
 
 void Cell::InvalidCache() {
-  impl_->InvalidateCache();
+  Trace::Scope trace("Cell::InvalidCache", position_);
+  uint64_t invalidated =
+      content_.GetFormula() && content_.IsCacheValid() ? 1 : 0;
+  content_.InvalidateCache();
+  sheet_.NoteChange(position_);
+
+  // Если формула устарела, то устарели и все зависящие от неё формулы,
+  // поэтому обход останавливается на уже сброшенных кэшах. Стек явный:
+  // цепочки зависимостей бывают длиннее, чем позволяет стек вызовов.
+  std::vector<Cell *> stack = {this};
+  while (!stack.empty()) {
+    Cell *cell = stack.back();
+    stack.pop_back();
+    cell->ForEachDependent([this, &stack, &invalidated](Cell *dependent) {
+      if (dependent->content_.IsCacheValid()) {
+        dependent->content_.InvalidateCache();
+        sheet_.NoteChange(dependent->position_);
+        stack.push_back(dependent);
+        ++invalidated;
+      }
+    });
+  }
+  sheet_.GetStatsCounters().Add(SheetStatsCounters::INVALIDATED_CACHES,
+                                invalidated);
+}
 
-  for (Cell *cell : referenced_cells_) {
-    if (!cell) {
-      continue;
-    }
-    if (cell->impl_->IsCacheValid()) {
-      cell->InvalidCache();
+void Cell::Clear() { Set(std::string()); }
+
+void Cell::PrepareValue() const {
+  SheetStatsCounters &stats = sheet_.GetStatsCounters();
+  if (content_.IsCacheValid()) {
+    if (content_.GetFormula()) {
+      stats.Add(SheetStatsCounters::CACHE_HITS);
     }
+    return;
   }
+  stats.Add(SheetStatsCounters::CACHE_MISSES);
+  sheet_.Evaluate(*this);
 }
 
-void Cell::Clear() { impl_ = std::make_unique<EmptyImpl>(); }
+Cell::Value Cell::GetValue() const {
+  PrepareValue();
+  return content_.GetValue(sheet_);
+}
 
-Cell::Value Cell::GetValue() const { return impl_->GetValue(); }
+std::string Cell::GetText() const { return content_.GetText(); }
 
-std::string Cell::GetText() const { return impl_->GetText(); }
+Cell::NumericValue Cell::GetNumericValue() const {
+  PrepareValue();
+  return content_.GetNumericValue(sheet_);
+}
 
 std::vector<Position> Cell::GetReferencedCells() const {
-  return impl_->GetReferencedCells();
-}
-
-bool Cell::CircularDependency(
-    std::unique_ptr<Cell::Impl> &impl) const {
-  auto positions = impl->GetReferencedCells();
-  PositionsSet dependents(positions.begin(), positions.end());
-  PositionsSet checkeds;
-  return DFS(dependents, checkeds);
-}
-
-bool Cell::DFS(const PositionsSet &dependents,
-               PositionsSet &verified) const {
-  // Если текущая ячейка уже есть среди зависимых, значит, цикл найден
-  if (dependents.count(position_)) {
-    return true;
-  }
-  for (Position pos : dependents) {
-    if (pos.IsValid() && !verified.count(pos)) {
-      verified.insert(pos);
-      auto cell = sheet_.GetConcreteCell(pos);
-      if (cell) {
-        auto ref = cell->GetReferencedCells();
-        if (DFS({ref.begin(), ref.end()}, verified)) {
-          return true;
-        }
+  return content_.GetReferencedCells();
+}
+
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+  return content_.GetReferencedRanges();
+}
+
+bool Cell::IsEmpty() const { return content_.IsEmpty(); }
+
+std::optional<Cell::NumericValue> Cell::GetAggregateValue() const {
+  PrepareValue();
+  return content_.GetAggregateValue(sheet_);
+}
+
+void Cell::ResetVisit() const { visit_epoch_ = 0; }
+
+bool Cell::Visit(uint32_t epoch) const {
+  if (visit_epoch_ == epoch) {
+    return false;
+  }
+  visit_epoch_ = epoch;
+  return true;
+}
+
+bool Cell::CircularDependency(const std::vector<Position> &new_references,
+                              const std::vector<CellRange> &new_ranges) const {
+  Trace::Scope trace("Cell::CircularDependency", position_);
+  // Цикл появится, если одна из новых ссылок достижима из этой ячейки по
+  // зависимым формулам. Всё достижимое стоит в порядке позже ячейки, а
+  // ссылки, стоящие раньше неё, недостижимы. Поэтому достаточно обойти
+  // зависимые формулы с номерами не больше последней из новых ссылок.
+  // Сами ссылки отмечаются отдельным обходом, чтобы узнавать их без поиска.
+  const uint32_t targets_epoch = sheet_.BeginTraversal();
+  bool has_targets = false;
+  int64_t upper_bound = order_;
+  // Пустые ячейки ни от чего не зависят, поэтому достижимыми быть не могут
+  auto add_target = [&](const Cell *cell) {
+    if (cell->order_ > order_ && !cell->IsEmpty()) {
+      cell->Visit(targets_epoch);
+      has_targets = true;
+      upper_bound = std::max(upper_bound, cell->order_);
+    }
+  };
+  for (Position pos : new_references) {
+    if (pos == position_) {
+      return true;
+    }
+    // Ячейки вне печатной области пусты
+    if (const Cell *cell = sheet_.GetConcreteCell(pos)) {
+      add_target(cell);
+    }
+  }
+  for (const CellRange &range : new_ranges) {
+    if (range.Contains(position_)) {
+      return true;
+    }
+    sheet_.ForEachCellInRange(range, add_target);
+  }
+  if (!has_targets) {
+    return false;
+  }
+
+  const uint32_t epoch = sheet_.BeginTraversal();
+  bool found = false;
+  std::vector<const Cell *> stack = {this};
+  Visit(epoch);
+  while (!stack.empty() && !found) {
+    const Cell *cell = stack.back();
+    stack.pop_back();
+    cell->ForEachDependent([&](const Cell *dependent) {
+      if (found || dependent->order_ > upper_bound) {
+        return;
+      }
+      if (dependent->visit_epoch_ == targets_epoch) {
+        found = true;
+      } else if (dependent->Visit(epoch)) {
+        stack.push_back(dependent);
       }
+    });
+  }
+  return found;
+}
+
+void Cell::RestoreTopologicalOrder() {
+  Trace::Scope trace("Cell::RestoreTopologicalOrder", position_);
+  // Новые ссылки ведут в эту ячейку, и порядок нарушен только для ссылок,
+  // стоящих позже неё. Переставляются лишь ячейки между ней и последней
+  // такой ссылкой: влияющие на нарушающие ссылки (backward) и зависящие от
+  // этой ячейки (forward). Их номера собираются вместе и раздаются заново:
+  // сначала backward, затем forward, внутри групп прежний порядок
+  // сохраняется.
+  const uint32_t epoch = sheet_.BeginTraversal();
+  int64_t upper_bound = order_;
+  std::vector<Cell *> backward;
+  // Соседи по диапазонам могут повторяться, отметка обхода отсекает повторы
+  auto add_backward = [&](Cell *cell) {
+    if (cell->order_ > order_ && cell->Visit(epoch)) {
+      backward.push_back(cell);
     }
+  };
+  ForEachReferenced(add_backward);
+  if (backward.empty()) {
+    return;
+  }
+  for (const Cell *cell : backward) {
+    upper_bound = std::max(upper_bound, cell->order_);
+  }
+
+  for (size_t i = 0; i < backward.size(); ++i) {
+    backward[i]->ForEachReferenced(add_backward);
+  }
+
+  std::vector<Cell *> forward = {this};
+  Visit(epoch);
+  for (size_t i = 0; i < forward.size(); ++i) {
+    forward[i]->ForEachDependent([&](Cell *dependent) {
+      if (dependent->order_ < upper_bound && dependent->Visit(epoch)) {
+        forward.push_back(dependent);
+      }
+    });
+  }
+
+  auto by_order = [](const Cell *lhs, const Cell *rhs) {
+    return lhs->order_ < rhs->order_;
+  };
+  std::sort(backward.begin(), backward.end(), by_order);
+  std::sort(forward.begin(), forward.end(), by_order);
+
+  std::vector<int64_t> orders;
+  orders.reserve(backward.size() + forward.size());
+  for (const Cell *cell : backward) {
+    orders.push_back(cell->order_);
+  }
+  for (const Cell *cell : forward) {
+    orders.push_back(cell->order_);
+  }
+  std::sort(orders.begin(), orders.end());
+
+  auto next_order = orders.begin();
+  for (Cell *cell : backward) {
+    cell->order_ = *next_order++;
+  }
+  for (Cell *cell : forward) {
+    cell->order_ = *next_order++;
   }
-  return false;
 }
 ///////////////////////////
 
-bool Cell::Impl::IsCacheValid() const { return false; }
+namespace {
+// Значение в 64 битах: число хранится как есть (все NaN приводятся к
+// одному), а отсутствие значения и ошибки — NaN с отрицательным знаком и
+// своей полезной нагрузкой, которых среди приведённых чисел не бывает.
+constexpr uint64_t BOXED_TAG = 0xFFF8'0000'0000'0000;
+constexpr uint64_t EMPTY_CACHE = BOXED_TAG | 1;
+constexpr uint64_t ERROR_TAG = BOXED_TAG | 0x100;
+
+uint64_t PackValue(const FormulaInterface::Value &value) {
+  if (const auto *error = std::get_if<FormulaError>(&value)) {
+    return ERROR_TAG | static_cast<uint64_t>(error->GetCategory());
+  }
+  double number = std::get<double>(value);
+  if (std::isnan(number)) {
+    number = std::numeric_limits<double>::quiet_NaN();
+  }
+  uint64_t bits;
+  std::memcpy(&bits, &number, sizeof(bits));
+  return bits;
+}
 
-void Cell::Impl::InvalidateCache() const {}
+std::optional<FormulaInterface::Value> UnpackValue(uint64_t bits) {
+  if (bits == EMPTY_CACHE) {
+    return std::nullopt;
+  }
+  if ((bits & ~uint64_t{0xFF}) == ERROR_TAG) {
+    return FormulaError(static_cast<FormulaError::Category>(bits & 0xFF));
+  }
+  double number;
+  std::memcpy(&number, &bits, sizeof(number));
+  return number;
+}
 
-////////////////////////////
+// Текст трактуется как число, только если он целиком является записью
+// числа. from_chars не зависит от локали и не требует завершающего нуля.
+CellInterface::NumericValue ParseNumber(std::string_view text) {
+  const FormulaError not_a_number(FormulaError::Category::Value);
+  if (text.front() == ESCAPE_SIGN) {
+    return not_a_number;
+  }
 
-Cell::Value Cell::EmptyImpl::GetValue() const { return std::string(); }
+  const char *begin = text.data();
+  const char *end = begin + text.size();
+  // from_chars, в отличие от strtod, не принимает явный плюс
+  if (*begin == '+') {
+    ++begin;
+    if (begin != end && *begin == '-') {
+      return not_a_number;
+    }
+  }
+  double number = 0.0;
+  auto [ptr, ec] = std::from_chars(begin, end, number);
+  if (ec != std::errc() || ptr != end) {
+    return not_a_number;
+  }
+  return number;
+}
+} // namespace
 
-std::string Cell::EmptyImpl::GetText() const { return std::string(); }
+Cell::Content::Content() : value_(PackValue(0.0)) {}
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const { return {}; }
+Cell::Content::Content(std::string text, std::pmr::memory_resource *resource)
+    : resource_(resource), value_(PackValue(0.0)) {
+  if (text.empty()) {
+    return;
+  }
+  if (text.size() > 1 && text.front() == FORMULA_SIGN) {
+    SetFormula(ParseFormula(text.substr(1), resource)); // Обрезаем '='
+    value_.store(EMPTY_CACHE, std::memory_order_relaxed);
+    return;
+  }
 
-////////////////////////////////
+  if (text.size() <= SHORT_TEXT_CAPACITY) {
+    std::memcpy(short_text_, text.data(), text.size());
+    short_size_ = static_cast<uint8_t>(text.size());
+    kind_ = Kind::ShortText;
+  } else {
+    char *data = static_cast<char *>(resource->allocate(text.size(), 1));
+    std::memcpy(data, text.data(), text.size());
+    long_text_ = {data, text.size()};
+    kind_ = Kind::LongText;
+  }
+  value_.store(PackValue(ParseNumber(text)), std::memory_order_relaxed);
+}
 
-Cell::TextImpl::TextImpl(std::string text) : text_(std::move(text)) {}
+Cell::Content::Content(PoolPtr<FormulaInterface> formula,
+                       std::pmr::memory_resource *resource,
+                       std::optional<FormulaInterface::Value> cache)
+    : resource_(resource), value_(cache ? PackValue(*cache) : EMPTY_CACHE) {
+  SetFormula(std::move(formula));
+}
 
-Cell::Value Cell::TextImpl::GetValue() const {
-  if (!text_.empty() && text_.at(0) == ESCAPE_SIGN) {
-    return text_.substr(1);
-  } else {
-    return text_;
+// Содержимое переносится только потоком, который правит лист, поэтому
+// значение копируется обычными загрузкой и записью
+Cell::Content::Content(Content &&other) noexcept
+    : resource_(other.resource_),
+      value_(other.value_.load(std::memory_order_relaxed)),
+      kind_(other.kind_), short_size_(other.short_size_) {
+  std::memcpy(short_text_, other.short_text_, sizeof(short_text_));
+  other.kind_ = Kind::Empty;
+}
+
+Cell::Content &Cell::Content::operator=(Content &&other) noexcept {
+  if (this != &other) {
+    Release();
+    resource_ = other.resource_;
+    value_.store(other.value_.load(std::memory_order_relaxed),
+                 std::memory_order_release);
+    std::memcpy(short_text_, other.short_text_, sizeof(short_text_));
+    kind_ = other.kind_;
+    short_size_ = other.short_size_;
+    other.kind_ = Kind::Empty;
   }
+  return *this;
 }
 
-std::string Cell::TextImpl::GetText() const { return text_; }
+Cell::Content::~Content() { Release(); }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const { return {}; }
+void Cell::Content::SetFormula(PoolPtr<FormulaInterface> formula) {
+  const PoolDeleter &deleter = formula.get_deleter();
+  assert(deleter.GetResource() == resource_);
+  formula_ = {formula.release(), static_cast<uint32_t>(deleter.GetSize()),
+              static_cast<uint32_t>(deleter.GetAlignment())};
+  kind_ = Kind::Formula;
+}
 
-//////////////////////////////
+void Cell::Content::Release() {
+  if (kind_ == Kind::LongText) {
+    resource_->deallocate(long_text_.data, long_text_.size, 1);
+  } else if (kind_ == Kind::Formula) {
+    PoolDeleter(resource_, formula_.size, formula_.alignment)(formula_.object);
+  }
+  kind_ = Kind::Empty;
+}
 
-Cell::FormulaImpl::FormulaImpl(std::string text, const SheetInterface &sheet)
-    : sheet_(sheet), formula_(ParseFormula(text.substr(1))) // Обрезаем '='
+std::string_view Cell::Content::GetTextView() const {
+  switch (kind_) {
+  case Kind::ShortText:
+    return {short_text_, short_size_};
+  case Kind::LongText:
+    return {long_text_.data, long_text_.size};
+  default:
+    return {};
+  }
+}
 
-{}
+FormulaInterface::Value
+Cell::Content::Compute(const SheetInterface &sheet) const {
+  FormulaInterface::Value value = formula_.object->Evaluate(sheet);
+  value_.store(PackValue(value), std::memory_order_release);
+  return value;
+}
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-  if (IsCacheValid()) {
-    if (std::holds_alternative<double>(cache_.value())) {
-      return std::get<double>(cache_.value());
-    } else {
-      return std::get<FormulaError>(cache_.value());
+Cell::Value Cell::Content::GetValue(const SheetInterface &sheet) const {
+  if (kind_ == Kind::Formula) {
+    FormulaInterface::Value value =
+        IsCacheValid() ? *GetCache() : Compute(sheet);
+    if (std::holds_alternative<double>(value)) {
+      return std::get<double>(value);
     }
+    return std::get<FormulaError>(value);
+  }
+  std::string_view text = GetTextView();
+  if (!text.empty() && text.front() == ESCAPE_SIGN) {
+    text.remove_prefix(1);
   }
+  return std::string(text);
+}
 
-  cache_ = formula_->Evaluate(sheet_);
-  if (std::holds_alternative<double>(cache_.value())) {
-    return std::get<double>(cache_.value());
-  } else {
-    return std::get<FormulaError>(cache_.value());
+std::string Cell::Content::GetText() const {
+  if (kind_ == Kind::Formula) {
+    return FORMULA_SIGN + formula_.object->GetExpression();
   }
+  return std::string(GetTextView());
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-  return FORMULA_SIGN + formula_->GetExpression();
+Cell::NumericValue
+Cell::Content::GetNumericValue(const SheetInterface &sheet) const {
+  if (auto value = GetCache()) {
+    return *value;
+  }
+  return Compute(sheet);
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-  return formula_->GetReferencedCells();
+// Агрегатные функции, как и в электронных таблицах, пропускают пустые
+// ячейки и текст, который не является числом
+std::optional<Cell::NumericValue>
+Cell::Content::GetAggregateValue(const SheetInterface &sheet) const {
+  if (kind_ == Kind::Empty) {
+    return std::nullopt;
+  }
+  NumericValue value = GetNumericValue(sheet);
+  if (kind_ != Kind::Formula && !std::holds_alternative<double>(value)) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+std::vector<Position> Cell::Content::GetReferencedCells() const {
+  if (kind_ != Kind::Formula) {
+    return {};
+  }
+  return formula_.object->GetReferencedCells();
+}
+
+std::vector<CellRange> Cell::Content::GetReferencedRanges() const {
+  if (kind_ != Kind::Formula) {
+    return {};
+  }
+  return formula_.object->GetReferencedRanges();
+}
+
+bool Cell::Content::IsCacheValid() const {
+  return value_.load(std::memory_order_acquire) != EMPTY_CACHE;
 }
 
-bool Cell::FormulaImpl::IsCacheValid() const { return cache_.has_value(); }
+void Cell::Content::InvalidateCache() const {
+  if (kind_ == Kind::Formula) {
+    value_.store(EMPTY_CACHE, std::memory_order_release);
+  }
+}
 
-void Cell::FormulaImpl::InvalidateCache() const { cache_.reset(); }
\ No newline at end of file
+std::optional<FormulaInterface::Value> Cell::Content::GetCache() const {
+  return UnpackValue(value_.load(std::memory_order_acquire));
+}
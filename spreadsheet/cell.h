@@ -2,85 +2,196 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory_pool.h"
+#include "small_vector.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class Sheet;
+class RecalcEngine;
 
 class Cell : public CellInterface {
 public:
-  Cell(Sheet &sheet, Position Position);
+  // order — место новой ячейки в топологическом порядке, его выдаёт Sheet
+  Cell(Sheet &sheet, Position Position, int64_t order);
 
-  virtual ~Cell() override = default;
+  virtual ~Cell() override;
+  Cell(const Cell &) = delete;
+  Cell &operator=(const Cell &) = delete;
 
   void Set(std::string text);
   void Clear();
 
   Value GetValue() const override;
   std::string GetText() const override;
+  NumericValue GetNumericValue() const override;
 
   std::vector<Position> GetReferencedCells() const override;
+  // Диапазоны агрегатных функций формулы
+  std::vector<CellRange> GetReferencedRanges() const;
 
-private:
-  // можете воспользоваться нашей подсказкой, но это необязательно.
-  class Impl {
-  public:
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-    virtual bool IsCacheValid() const;
-    virtual void InvalidateCache() const;
-  };
-
-  class TextImpl final : public Impl {
-  public:
-    TextImpl(std::string text);
+  bool IsEmpty() const;
 
-    virtual Value GetValue() const override;
-    virtual std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+  // Значение ячейки внутри диапазона агрегатной функции; nullopt для пустой
+  // ячейки и текста, который не является числом
+  std::optional<NumericValue> GetAggregateValue() const;
 
-  private:
-    std::string text_;
-  };
+  // Сбрасывает отметку обхода графа, см. Sheet::BeginTraversal
+  void ResetVisit() const;
 
-  class FormulaImpl final : public Impl {
+private:
+  friend class BinarySnapshot;
+  friend class RecalcEngine;
+  friend class Sheet;
+
+  // Содержимое ячейки без графа зависимостей: пусто, текст или формула.
+  // Вид хранится меткой, поэтому обращения к содержимому обходятся без
+  // виртуальных вызовов. Текст до SHORT_TEXT_CAPACITY байт лежит прямо в
+  // объекте, длинный текст и формула — в памяти resource.
+  //
+  // Значение упаковано в 64 бита (см. PackValue в cell.cpp): у текста это
+  // число, которым он трактуется в формулах, у формулы — кэш вычисленного
+  // значения. Читатели берут его одной атомарной загрузкой без блокировок;
+  // одновременные вычисления одной формулы публикуют одно и то же значение.
+  class Content {
   public:
-    FormulaImpl(std::string text, const SheetInterface &sheet);
-
-    virtual Value GetValue() const override;
-    virtual std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    virtual bool IsCacheValid() const override;
-    virtual void InvalidateCache() const override;
+    static constexpr size_t SHORT_TEXT_CAPACITY = 16;
+
+    Content();
+    // Разбирает текст ячейки. Бросает FormulaException, если формула
+    // некорректна.
+    Content(std::string text, std::pmr::memory_resource *resource);
+    // Готовая формула, размещённая в resource, и, если известно, её
+    // вычисленное значение
+    Content(PoolPtr<FormulaInterface> formula,
+            std::pmr::memory_resource *resource,
+            std::optional<FormulaInterface::Value> cache);
+    Content(Content &&other) noexcept;
+    Content &operator=(Content &&other) noexcept;
+    ~Content();
+
+    bool IsEmpty() const { return kind_ == Kind::Empty; }
+    const FormulaInterface *GetFormula() const {
+      return kind_ == Kind::Formula ? formula_.object : nullptr;
+    }
+
+    // Значения формулы вычисляются по sheet, если кэш устарел
+    Value GetValue(const SheetInterface &sheet) const;
+    std::string GetText() const;
+    NumericValue GetNumericValue(const SheetInterface &sheet) const;
+    std::optional<NumericValue>
+    GetAggregateValue(const SheetInterface &sheet) const;
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+
+    // У текста и пустой ячейки значение всегда актуально
+    bool IsCacheValid() const;
+    void InvalidateCache() const;
+    // Вычисленное значение формулы, если оно актуально
+    std::optional<FormulaInterface::Value> GetCache() const;
 
   private:
-    const SheetInterface &sheet_;
-    std::unique_ptr<FormulaInterface> formula_;
-    mutable std::optional<FormulaInterface::Value> cache_;
+    enum class Kind : uint8_t { Empty, ShortText, LongText, Formula };
+
+    struct LongText {
+      char *data;
+      size_t size;
+    };
+
+    // Формула без PoolPtr: размер нужен, чтобы вернуть память resource_
+    struct PooledFormula {
+      FormulaInterface *object;
+      uint32_t size;
+      uint32_t alignment;
+    };
+
+    // Вычисляет формулу и публикует значение в кэше
+    FormulaInterface::Value Compute(const SheetInterface &sheet) const;
+    std::string_view GetTextView() const;
+    void SetFormula(PoolPtr<FormulaInterface> formula);
+    void Release();
+
+    std::pmr::memory_resource *resource_ = nullptr;
+    mutable std::atomic<uint64_t> value_;
+    union {
+      char short_text_[SHORT_TEXT_CAPACITY];
+      LongText long_text_;
+      PooledFormula formula_;
+    };
+    Kind kind_ = Kind::Empty;
+    uint8_t short_size_ = 0;
   };
 
-  class EmptyImpl final : public Impl {
-  public:
-    virtual Value GetValue() const override;
-    virtual std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+  // Ссылка формулы на ячейку вместе с местом формулы в dependent_cells
+  // этой ячейки: по нему ребро удаляется за O(1), сколько бы формул ни
+  // ссылалось на ячейку
+  struct Reference {
+    Cell *cell;
+    uint32_t dependent_index;
   };
 
-  Sheet &sheet_;
-
-  std::unique_ptr<Impl> impl_; // Значение ячейки таблицы
-  std::unordered_set<Cell *> dependent_cells_;
-  std::unordered_set<Cell *> referenced_cells_;
+  // Рёбра графа зависимостей и диапазоны формулы. Нужны не всем ячейкам и
+  // не при каждом обращении, поэтому вынесены из ячейки и создаются в
+  // памяти листа при появлении первого ребра. Обычно рёбер у ячейки
+  // несколько, и они лежат прямо в Links.
+  struct Links {
+    explicit Links(std::pmr::memory_resource *resource)
+        : dependent_cells(resource), referenced_cells(resource),
+          referenced_ranges(resource) {}
+
+    SmallVector<Cell *, 4> dependent_cells;     // формулы, ссылающиеся на ячейку
+    SmallVector<Reference, 2> referenced_cells; // ячейки, на которые ссылается формула, без повторов
+    // Диапазоны формулы. Ячейки диапазонов не получают рёбер: формулы,
+    // покрывающие ячейку, находит индекс диапазонов в Sheet.
+    std::pmr::vector<CellRange> referenced_ranges;
+  };
 
-  void NewReference(const std::vector<Position> &new_dependents);
+  Sheet &sheet_;
+  Content content_; // Значение ячейки таблицы
+  Links *links_ = nullptr;
+
+  Links &GetLinks();
+  // Удаляет ребро dependent_cells[index], поправляя место переставленного
+  // на его место ребра у его формулы
+  void RemoveDependent(uint32_t index);
+
+  // Обходят соседей в графе зависимостей: формулы, которые зависят от
+  // ячейки, и существующие ячейки, от которых зависит формула (прямые
+  // ссылки и ячейки диапазонов). Соседи по диапазонам могут повторяться.
+  // Определены в sheet.h, так как им нужен полный тип Sheet.
+  template <typename Visitor> void ForEachDependent(Visitor &&visitor) const;
+  template <typename Visitor> void ForEachReferenced(Visitor &&visitor) const;
+
+  // Вычисляет формулу, если её кэш устарел, и учитывает обращение в
+  // счётчиках листа
+  void PrepareValue() const;
+
+  void NewReference(const std::vector<Position> &new_references,
+                    const std::vector<CellRange> &new_ranges);
   void InvalidCache();
-  bool CircularDependency(std::unique_ptr<Cell::Impl> &impl)
-      const; // Проверка циклической зависимости
-  bool DFS(const PositionsSet &dependents, PositionsSet &verified) const;
+  // Проверка циклической зависимости для будущих ссылок ячейки
+  bool CircularDependency(const std::vector<Position> &new_references,
+                          const std::vector<CellRange> &new_ranges) const;
+  // Восстанавливает топологический порядок после появления новых ссылок
+  void RestoreTopologicalOrder();
+  // Отмечает ячейку посещённой обходом epoch; false, если уже была отмечена
+  bool Visit(uint32_t epoch) const;
 
   Position position_;
+
+  // Место ячейки в поддерживаемом топологическом порядке (Pearce–Kelly):
+  // каждая ячейка стоит раньше формул, которые на неё ссылаются. Номера
+  // уникальны, но не обязательно идут подряд.
+  int64_t order_;
+
+  // Номер последнего обхода графа, посетившего ячейку. Обходы берут новый
+  // номер у Sheet::BeginTraversal и не заводят множеств посещённых ячеек.
+  mutable uint32_t visit_epoch_ = 0;
 };
\ No newline at end of file
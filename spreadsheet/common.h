@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -24,18 +25,48 @@ struct Position {
 
     static Position FromString(std::string_view str);
 
+    // Позиция, упакованная в одно число: строка в старших 32 битах,
+    // столбец в младших. Ключи сравниваются так же, как позиции.
+    uint64_t GetKey() const {
+        return uint64_t(uint32_t(row)) << 32 | uint32_t(col);
+    }
+
+    static Position FromKey(uint64_t key) {
+        return {int(uint32_t(key >> 32)), int(uint32_t(key))};
+    }
+
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
     static const Position NONE;
 };
 
+// Фибоначчиево хеширование упакованного ключа: соседние строки и столбцы
+// расходятся по всему диапазону, поэтому плотные блоки и диагонали не
+// собираются в одни корзины
 struct PositionHasher {
+    static constexpr uint64_t MULTIPLIER = 0x9E3779B97F4A7C15;
+
     size_t operator()(const Position& pos) const {
-        return std::hash<int>()(pos.row) ^ (std::hash<int>()(pos.col) << 1); 
+        const uint64_t hash = pos.GetKey() * MULTIPLIER;
+        return static_cast<size_t>(hash ^ (hash >> 32));
     }
 };
 
-using PositionsSet = std::unordered_set<Position, PositionHasher>;
+// Прямоугольный диапазон ячеек, например A1:B100. Обе границы входят в
+// диапазон, first — левый верхний угол, last — правый нижний.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Диапазон по двум любым противоположным углам
+    static CellRange FromCorners(Position lhs, Position rhs);
+};
 
 struct Size {
     int rows = 0;
@@ -87,11 +118,29 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение пакетной записи ячеек (Sheet::SetCells): перечисляет все
+// ячейки, входящие в циклы, в порядке позиций
+class CyclicCellsException : public CircularDependencyException {
+public:
+    CyclicCellsException(const std::string& what, std::vector<Position> cells)
+        : CircularDependencyException(what), cells_(std::move(cells)) {
+    }
+
+    const std::vector<Position>& GetCells() const {
+        return cells_;
+    }
+
+private:
+    std::vector<Position> cells_;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // Значение ячейки как аргумента формулы
+    using NumericValue = std::variant<double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -104,9 +153,16 @@ public:
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // Возвращает значение ячейки так, как его видит ссылающаяся формула.
+    // Пустая ячейка - ноль, текст - записанное в нём число или ошибка
+    // #VALUE!, если текст не является числом. Ничего не копирует и не
+    // разбирает при каждом вызове.
+    virtual NumericValue GetNumericValue() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
+    // ячеек. В случае текстовой ячейки список пуст. Ячейки из диапазонов
+    // агрегатных функций (SUM(A1:B100)) не перечисляются.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
@@ -138,6 +194,14 @@ public:
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Дописывает в numbers значения ячеек диапазона для агрегатных функций
+    // формул (SUM, AVERAGE, MIN, MAX). Пустые ячейки и текст, не являющийся
+    // числом, пропускаются. Если в диапазоне есть формулы с ошибкой,
+    // возвращает ошибку первой из них по строкам (наименьшая строка, затем
+    // наименьший столбец) независимо от того, как лист хранит ячейки.
+    virtual std::optional<FormulaError> GetRangeNumbers(
+        CellRange range, std::vector<double>& numbers) const = 0;
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
@@ -6,6 +6,7 @@
 #include <cassert>
 #include <cctype>
 #include <sstream>
+#include <tuple>
 
 using namespace std::literals;
 
@@ -17,45 +18,28 @@ namespace {
 class Formula : public FormulaInterface {
 public:
   // Реализуйте следующие методы:
-  explicit Formula(std::string expression) try
-      : ast_(ParseFormulaAST(expression)) {
+  Formula(std::string expression, std::pmr::memory_resource *resource) try
+      : ast_(ParseFormulaAST(expression, resource)) {
   } catch (const FormulaException &error) {
     throw error;
   }
 
+  explicit Formula(FormulaAST ast) : ast_(std::move(ast)) {}
+
   Value Evaluate(const SheetInterface &sheet) const override {
-    std::function<double(Position)> args = [&sheet](Position pos) {
-      if (!sheet.GetCell(pos)) {
+    FormulaAST::CellValueGetter args = [&sheet](Position pos) -> Value {
+      const CellInterface *cell = sheet.GetCell(pos);
+      if (!cell) {
         return 0.0;
       }
-      auto value = sheet.GetCell(pos)->GetValue();
-      if (std::holds_alternative<double>(value)) {
-        return std::get<double>(value);
-      } else if (std::holds_alternative<std::string>(value)) {
-        std::string text = sheet.GetCell(pos)->GetText();
-
-        if (text.empty()) {
-          return 0.0;
-        }
-        if (text.front() == ESCAPE_SIGN) {
-          throw FormulaError(FormulaError::Category::Value);
-        }
-
-        try {
-          return std::stod(text);
-        } catch (...) {
-          throw FormulaError(FormulaError::Category::Value);
-        }
-      } else {
-        throw std::get<FormulaError>(value);
-      }
+      return cell->GetNumericValue();
     };
+    FormulaAST::RangeNumbersGetter range_numbers =
+        [&sheet](CellRange range, std::vector<double> &numbers) {
+          return sheet.GetRangeNumbers(range, numbers);
+        };
 
-    try {
-      return ast_.Execute(args);
-    } catch (const FormulaError &fe) {
-      return fe;
-    }
+    return ast_.Execute(args, range_numbers);
   }
 
   std::string GetExpression() const override {
@@ -67,26 +51,59 @@ public:
   }
 
   std::vector<Position> GetReferencedCells() const override {
+    // Ячейки в AST уже отсортированы, остаётся убрать повторы
     std::vector<Position> result;
-    std::set<Position> set_of_pos;
     for (const auto &pos : ast_.GetCells()) {
-      if (pos.IsValid()) {
-        set_of_pos.insert(pos);
-      } else {
-        continue;
+      if (pos.IsValid() && (result.empty() || !(result.back() == pos))) {
+        result.push_back(pos);
       }
     }
-    for (const auto &cell : set_of_pos) {
-      result.push_back(cell);
-    }
     return result;
   }
 
+  std::vector<CellRange> GetReferencedRanges() const override {
+    const auto &ranges = ast_.GetRanges();
+    std::vector<CellRange> result(ranges.begin(), ranges.end());
+    std::sort(result.begin(), result.end(),
+              [](const CellRange &lhs, const CellRange &rhs) {
+                return std::tie(lhs.first, lhs.last) <
+                       std::tie(rhs.first, rhs.last);
+              });
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+
+  const ASTImpl::Program &GetProgram() const override {
+    return ast_.GetProgram();
+  }
+
 private:
   FormulaAST ast_;
 };
 } // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-  return std::make_unique<Formula>(std::move(expression));
+  return std::make_unique<Formula>(std::move(expression),
+                                   std::pmr::get_default_resource());
+}
+
+PoolPtr<FormulaInterface> ParseFormula(std::string expression,
+                                       std::pmr::memory_resource *resource) {
+  return MakePooled<Formula>(resource, std::move(expression), resource);
+}
+
+PoolPtr<FormulaInterface> LoadFormula(ASTImpl::Program program) {
+  std::pmr::memory_resource *resource = program.get_allocator().resource();
+  std::pmr::forward_list<Position> cells(resource);
+  for (const auto &instruction : program) {
+    if (instruction.op == ASTImpl::OpCode::Cell) {
+      cells.push_front(instruction.cell);
+    }
+  }
+  try {
+    return MakePooled<Formula>(resource,
+                               FormulaAST(std::move(program), std::move(cells)));
+  } catch (const ParsingError &) {
+    throw FormulaException("Malformed formula program");
+  }
 }
\ No newline at end of file
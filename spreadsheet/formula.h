@@ -1,14 +1,23 @@
 #pragma once
 
 #include "common.h"
+#include "memory_pool.h"
 
 #include <memory>
+#include <memory_resource>
 #include <vector>
 
+namespace ASTImpl {
+struct Instruction;
+}
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX от выражений и диапазонов:
+//   SUM(A1:B100), MAX(A1*2, C1:C10) — диапазон допустим только аргументом
+//   функции
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -33,10 +42,28 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов сюда не входят, см. GetReferencedRanges.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны из аргументов агрегатных функций без повторов.
+    // Зависимость от диапазона хранится целиком, поэтому её стоимость не
+    // зависит от его площади.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Скомпилированная программа формулы, см. ASTImpl::Instruction
+    virtual const std::pmr::vector<ASTImpl::Instruction>& GetProgram() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// То же, но формула вместе с программой размещается в resource — так
+// формулы ячеек живут в памяти своего листа
+PoolPtr<FormulaInterface> ParseFormula(std::string expression,
+                                       std::pmr::memory_resource* resource);
+
+// Собирает формулу из готовой программы (например, сохранённой GetProgram)
+// без разбора текста. Формула размещается в ресурсе памяти программы.
+// Бросает FormulaException, если программа некорректна.
+PoolPtr<FormulaInterface> LoadFormula(std::pmr::vector<ASTImpl::Instruction> program);
@@ -1,8 +1,26 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
 
+#include "binary_snapshot.h"
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "positions_set.h"
+#include "range_index.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "text_import.h"
+#include "thread_pool.h"
+#include "trace.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -12,6 +30,10 @@ inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
 
+inline std::ostream& operator<<(std::ostream& output, const CellRange& range) {
+    return output << range.ToString();
+}
+
 inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
@@ -178,6 +200,29 @@ void TestFormulaExpressionFormatting() {
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
 }
 
+void TestFormulaExpressionParentheses() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+    ASSERT_EQUAL(reformat("(1-2)-3"), "1-2-3");
+    ASSERT_EQUAL(reformat("-(1+2)"), "-(1+2)");
+    ASSERT_EQUAL(reformat("+(1+2)/3"), "+(1+2)/3");
+    ASSERT_EQUAL(reformat("1/(2*3)"), "1/(2*3)");
+    ASSERT_EQUAL(reformat("(1*2)/3"), "1*2/3");
+    ASSERT_EQUAL(reformat("(-A1)*(B2)"), "-A1*B2");
+}
+
+void TestFormulaDeepNesting() {
+    auto sheet = CreateSheet();
+    std::string expr = "1";
+    for (int i = 0; i < 100; ++i) {
+        expr = "1+(" + expr + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(expr)->Evaluate(*sheet)), 101);
+}
+
 void TestFormulaReferencedCells() {
     ASSERT(ParseFormula("1")->GetReferencedCells().empty());
 
@@ -192,6 +237,81 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+// Разбирает выражение ANTLR-парсером и собственным парсером и сравнивает
+// результаты: оба должны либо отвергнуть формулу, либо построить одинаковые
+// программы с одинаковыми списками ячеек.
+void CheckParsersAgree(const std::string& expression) {
+    std::optional<FormulaAST> antlr_ast;
+    try {
+        std::istringstream in(expression);
+        antlr_ast.emplace(ParseFormulaAST(in));
+    } catch (...) {
+    }
+
+    std::optional<FormulaAST> fast_ast;
+    try {
+        fast_ast.emplace(ParseFormulaAST(expression));
+    } catch (const FormulaException&) {
+    }
+
+    AssertEqual(antlr_ast.has_value(), fast_ast.has_value(), expression);
+    if (!antlr_ast) {
+        return;
+    }
+
+    const auto& expected = antlr_ast->GetProgram();
+    const auto& actual = fast_ast->GetProgram();
+    AssertEqual(expected.size(), actual.size(), expression);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        Assert(expected[i].op == actual[i].op, expression);
+        if (expected[i].op == ASTImpl::OpCode::Number) {
+            AssertEqual(expected[i].number, actual[i].number, expression);
+        } else if (expected[i].op == ASTImpl::OpCode::Cell) {
+            AssertEqual(expected[i].cell, actual[i].cell, expression);
+        } else if (expected[i].op == ASTImpl::OpCode::Range) {
+            Assert(expected[i].range == actual[i].range, expression);
+        } else if (ASTImpl::IsAggregate(expected[i].op)) {
+            AssertEqual(expected[i].arguments.scalars, actual[i].arguments.scalars, expression);
+            AssertEqual(expected[i].arguments.ranges, actual[i].arguments.ranges, expression);
+        }
+    }
+    Assert(antlr_ast->GetCells() == fast_ast->GetCells(), expression);
+}
+
+void TestFormulaParsersAgree() {
+    const std::vector<std::string> expressions = {
+        "1", "  42  ", "1+2*3", "(1+2)*3", "1-2-3", "1/2/3", "-1", "+-+-1",
+        "-A1*B2", "2*-3", "((((1))))", "1e5", "1E+5", "2.5e-3", ".5", "0.25",
+        "1e-400", "1e400", "007", "A01", "ZZZ1", "XFD16384", "XFE16384",
+        "A0", "AAAA1", "A1B2", "1.", "1.e5", "1e", "1e+", "A", "a1", "",
+        " ", "()", "(1", "1)", "1 2", "1+", "*1", "1**2", "2A1", "1\t+\n2\r",
+        "1.5.3", "A1:B2", "1%", "3X", "A2B", "((1)", "2+4-",
+        "SUM(A1:B2)", "SUM(1,2)", "AVERAGE(A1:B2,C3+1,2)", "MAX(MIN(A1:A3),B1)",
+        "SUM()", "SUM(A1:)", "SUM A1", "SUMA1", "FOO(1)", "SUM(1,)", "SUM(B5:A1)",
+        "-SUM(A1:A2)*2", "SUM((A1:B2))", "SUM(A1:B2:C3)", "MIN(A1*2,B1:B2)",
+        "sum(A1:B2)", "SUM(A0:B2)", "SUM",
+    };
+    for (const auto& expression : expressions) {
+        CheckParsersAgree(expression);
+    }
+
+    const std::vector<std::string> tokens = {
+        "1", "23", "4.5", ".5", "6e2", "7E-1", "A1", "B22", "ZZ9", "XFD16384",
+        "(", ")", "+", "-", "*", "/", " ", "A", "e", "1.", "AB12", "0x1",
+        "SUM(", "MAX(", ",", ":",
+    };
+    std::mt19937 random(2024);
+    std::uniform_int_distribution<size_t> token_dist(0, tokens.size() - 1);
+    std::uniform_int_distribution<int> length_dist(1, 12);
+    for (int i = 0; i < 5000; ++i) {
+        std::string expression;
+        for (int length = length_dist(random); length > 0; --length) {
+            expression += tokens[token_dist(random)];
+        }
+        CheckParsersAgree(expression);
+    }
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -204,6 +324,23 @@ void TestErrorValue() {
                     CellInterface::Value(FormulaError::Category::Value));
 }
 
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "3D");
+    sheet->SetCell("B2"_pos, "1e3");
+    sheet->SetCell("C1"_pos, "=B1*2");
+    sheet->SetCell("C2"_pos, "=B2*2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), CellInterface::Value(2000.0));
+
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=C2-A2");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
 void TestErrorArithmetic() {
     auto sheet = CreateSheet();
 
@@ -246,12 +383,271 @@ void TestErrorArithmetic() {
     }
 }
 
+void TestRangeErrorOrder() {
+    // Q12 лежит в следующем блоке хранения, O15 — в первом, но Q12 раньше
+    // по строкам, поэтому диапазон сообщает её ошибку
+    Sheet sheet;
+    sheet.SetCell("E8"_pos, "text");
+    sheet.SetCell("Q12"_pos, "=AVERAGE(E9:K9,-(E8-G18))");
+    sheet.SetCell("O15"_pos, "=(D5-(1/0))");
+    sheet.SetCell("A1"_pos, "=MIN(M12:R17)");
+    const FormulaError value(FormulaError::Category::Value);
+    const FormulaError arithmetic(FormulaError::Category::Arithmetic);
+    ASSERT_EQUAL(sheet.GetCell("Q12"_pos)->GetValue(), CellInterface::Value(value));
+    ASSERT_EQUAL(sheet.GetCell("O15"_pos)->GetValue(), CellInterface::Value(arithmetic));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(value));
+
+    // Та же граница в обратную сторону и граница блоков по строкам
+    sheet.ClearCell("Q12"_pos);
+    sheet.ClearCell("O15"_pos);
+    sheet.SetCell("O12"_pos, "=1/0");
+    sheet.SetCell("Q15"_pos, "=E8+1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(arithmetic));
+    sheet.ClearCell("O12"_pos);
+    sheet.SetCell("O17"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(value));
+
+    // Сверка с обходом по строкам на случайных листах
+    std::mt19937 random(11);
+    auto coordinate = [&random](int limit) {
+        return std::uniform_int_distribution<int>(0, limit - 1)(random);
+    };
+    for (int round = 0; round < 50; ++round) {
+        Sheet random_sheet;
+        random_sheet.SetCell("Z1000"_pos, "text");
+        for (int i = 0; i < 12; ++i) {
+            const Position pos{coordinate(40), coordinate(40)};
+            const int kind = coordinate(3);
+            random_sheet.SetCell(pos, kind == 0 ? "=1/0" : kind == 1 ? "=Z1000+1" : "5");
+        }
+        const Position first{coordinate(20), coordinate(20)};
+        const CellRange range{first, {first.row + coordinate(20), first.col + coordinate(20)}};
+        std::optional<FormulaError> expected;
+        for (int row = range.first.row; row <= range.last.row && !expected; ++row) {
+            for (int col = range.first.col; col <= range.last.col && !expected; ++col) {
+                const CellInterface* cell = random_sheet.GetCell({row, col});
+                if (!cell) {
+                    continue;
+                }
+                const CellInterface::Value cell_value = cell->GetValue();
+                if (auto* error = std::get_if<FormulaError>(&cell_value)) {
+                    expected = *error;
+                }
+            }
+        }
+        std::vector<double> numbers;
+        ASSERT(random_sheet.GetRangeNumbers(range, numbers) == expected);
+    }
+}
+
 void TestEmptyCellTreatedAsZero() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "=B2");
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
 }
 
+void TestFormulaRanges() {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < 100; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row + 1));
+        sheet->SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    sheet->SetCell("C1"_pos, "text");
+    sheet->SetCell("C2"_pos, "'5");
+    sheet->SetCell("C3"_pos, "7");
+
+    auto value = [&sheet](const std::string& formula) {
+        sheet->SetCell("E1"_pos, formula);
+        return sheet->GetCell("E1"_pos)->GetValue();
+    };
+    using Value = CellInterface::Value;
+    ASSERT_EQUAL(value("=SUM(A1:A100)"), Value(5050.0));
+    ASSERT_EQUAL(value("=SUM(A1:B100)"), Value(3 * 5050.0));
+    ASSERT_EQUAL(value("=AVERAGE(A1:A100)"), Value(50.5));
+    ASSERT_EQUAL(value("=MIN(B1:B100)+MAX(A1:A100)"), Value(102.0));
+    ASSERT_EQUAL(value("=SUM(A100:A1)"), Value(5050.0));
+    ASSERT_EQUAL(value("=MAX(A1:A3, 10, B1*7)"), Value(14.0));
+    ASSERT_EQUAL(value("=SUM(MAX(A1:A2), MIN(A3:A4), A5:A5)"), Value(10.0));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetText(), "=SUM(MAX(A1:A2),MIN(A3:A4),A5:A5)");
+
+    // Текст и пустые ячейки диапазона пропускаются, числовой текст считается
+    ASSERT_EQUAL(value("=SUM(C1:D10)"), Value(7.0));
+    ASSERT_EQUAL(value("=AVERAGE(C1:C3)"), Value(7.0));
+    ASSERT_EQUAL(value("=MAX(X1:Z9)"), Value(0.0));
+    ASSERT_EQUAL(value("=AVERAGE(X1:Z9)"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    // Ошибка внутри диапазона передаётся дальше; правка ячейки диапазона
+    // обновляет формулу
+    sheet->SetCell("A50"_pos, "=1/0");
+    ASSERT_EQUAL(value("=SUM(A1:A100)"), Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet->SetCell("A50"_pos, "0");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), Value(5000.0));
+
+    // Ячейки диапазонов не входят в GetReferencedCells
+    sheet->SetCell("F1"_pos, "=SUM(A1:A2)+B1");
+    ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetReferencedCells(),
+                 (std::vector<Position>{"B1"_pos}));
+
+    bool caught = false;
+    try {
+        sheet->SetCell("A1"_pos, "=SUM(F1:F2)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    for (const char* invalid : {"=A1:B2", "=SUM()", "=SUM(A1:)", "=FOO(1)", "=SUM(A1:B2+1)"}) {
+        caught = false;
+        try {
+            sheet->SetCell("G1"_pos, invalid);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        Assert(caught, invalid);
+    }
+}
+
+void TestRangeDependencies() {
+    Sheet sheet;
+    const Position last_row{Position::MAX_ROWS - 1, 0};
+    sheet.SetCell("B1"_pos, "=SUM(A1:" + last_row.ToString() + ")");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetConcreteCell("B1"_pos)->GetReferencedRanges(),
+                 (std::vector<CellRange>{{"A1"_pos, last_row}}));
+    // Для ячеек диапазона не заводятся пустые заглушки
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet.GetCell(last_row) == nullptr);
+
+    // Новая ячейка внутри диапазона сбрасывает кэш формулы
+    sheet.SetCell({9000, 0}, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.SetCell("C1"_pos, "=B1*2");
+    sheet.SetCell(last_row, "=E5+1");
+    sheet.SetCell("E5"_pos, "6");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(24.0));
+    sheet.ClearCell({9000, 0});
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    // Цикл через диапазон: новая ячейка диапазона ссылается на формулу
+    bool caught = false;
+    try {
+        sheet.SetCell("A2"_pos, "=C1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr || sheet.GetCell("A2"_pos)->GetText().empty());
+
+    // Пересекающиеся диапазоны и смена формулы снимают старые зависимости
+    sheet.SetCell("D1"_pos, "=SUM(A1:A3)+MAX(A2:A10)");
+    sheet.SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet.SetCell("D1"_pos, "=SUM(E1:E2)");
+    sheet.SetCell("A3"_pos, "=D1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestRangeIndex() {
+    // Сверка с перебором на случайных диапазонах, в том числе с повторами
+    std::mt19937 random(12);
+    auto coordinate = [&random](int limit) {
+        return std::uniform_int_distribution<int>(0, limit - 1)(random);
+    };
+    RangeIndex<int> index;
+    std::vector<std::pair<CellRange, int>> ranges;
+    for (int owner = 0; owner < 300; ++owner) {
+        const int first_row = coordinate(64);
+        const int first_col = coordinate(64);
+        const CellRange range{{first_row, first_col},
+                              {first_row + coordinate(64), first_col + coordinate(64)}};
+        index.Insert(range, owner % 100);
+        ranges.emplace_back(range, owner % 100);
+    }
+    for (size_t i = 0; i < ranges.size(); i += 3) {
+        index.Erase(ranges[i].first, ranges[i].second);
+    }
+    ASSERT_EQUAL(index.Size(), ranges.size() - (ranges.size() + 2) / 3);
+    for (int probe = 0; probe < 2000; ++probe) {
+        const Position pos{coordinate(130), coordinate(130)};
+        std::multiset<int> expected;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            if (i % 3 != 0 && ranges[i].first.Contains(pos)) {
+                expected.insert(ranges[i].second);
+            }
+        }
+        std::multiset<int> found;
+        index.ForEachCovering(pos, [&found](int owner) {
+            found.insert(owner);
+        });
+        ASSERT(found == expected);
+        ASSERT_EQUAL(index.Covers(pos), !expected.empty());
+    }
+
+    // Правка формулы с каждый раз новыми границами не копит узлы: опустевшие
+    // освобождаются и идут под следующие вставки
+    const size_t base_nodes = index.NodeCount();
+    for (int i = 0; i < 5000; ++i) {
+        const CellRange range{{i % 7, i % 13}, {100 + i, 20 + i % 300}};
+        index.Insert(range, -1);
+        ASSERT(index.Covers(range.last));
+        index.Erase(range, -1);
+        ASSERT_EQUAL(index.NodeCount(), base_nodes);
+    }
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (i % 3 != 0) {
+            index.Erase(ranges[i].first, ranges[i].second);
+        }
+    }
+    ASSERT_EQUAL(index.Size(), 0u);
+    ASSERT_EQUAL(index.NodeCount(), 0u);
+    ASSERT(!index.Covers({0, 0}));
+
+    // Много диапазонов на одних и тех же строках в разных столбцах
+    Sheet sheet;
+    const int columns = 200;
+    for (int col = 0; col < columns; ++col) {
+        const CellRange range{{0, col}, {999, col}};
+        sheet.SetCell({1000, col}, "=SUM(" + range.ToString() + ")");
+    }
+    sheet.SetCell({500, 7}, "3");
+    sheet.SetCell({0, 150}, "4");
+    for (int col = 0; col < columns; ++col) {
+        const double expected = col == 7 ? 3.0 : col == 150 ? 4.0 : 0.0;
+        ASSERT_EQUAL(sheet.GetCell({1000, col})->GetValue(), CellInterface::Value(expected));
+    }
+    std::vector<const Cell*> dependents;
+    sheet.ForEachRangeDependent({500, 7}, [&dependents](const Cell* cell) {
+        dependents.push_back(cell);
+    });
+    ASSERT(dependents == std::vector<const Cell*>{sheet.GetConcreteCell({1000, 7})});
+}
+
+void TestTextCellNumericValue() {
+    auto sheet = CreateSheet();
+    auto numeric = [&sheet](const std::string& text) {
+        sheet->SetCell("A1"_pos, text);
+        return sheet->GetCell("A1"_pos)->GetNumericValue();
+    };
+    using Number = CellInterface::NumericValue;
+    const Number not_a_number = FormulaError(FormulaError::Category::Value);
+
+    ASSERT_EQUAL(numeric("3.5") == Number(3.5), true);
+    ASSERT_EQUAL(numeric("-2e3") == Number(-2000.0), true);
+    ASSERT_EQUAL(numeric("+7") == Number(7.0), true);
+    ASSERT_EQUAL(numeric("'5") == not_a_number, true);
+    ASSERT_EQUAL(numeric("12abc") == not_a_number, true);
+    ASSERT_EQUAL(numeric("+-1") == not_a_number, true);
+    ASSERT_EQUAL(numeric("1e400") == not_a_number, true);
+    ASSERT_EQUAL(numeric("=1/0") == Number(FormulaError(FormulaError::Category::Arithmetic)), true);
+
+    // Ссылающаяся формула видит новое число после правки текста
+    sheet->SetCell("A1"_pos, "4");
+    sheet->SetCell("B1"_pos, "=A1*A1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(16.0));
+    sheet->SetCell("A1"_pos, "0.5");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.25));
+}
+
 void TestFormulaInvalidPosition() {
     auto sheet = CreateSheet();
     auto try_formula = [&](const std::string& formula) {
@@ -288,6 +684,23 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintableSizeShrinks() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("C5"_pos, "edge");
+    sheet->SetCell("B7"_pos, "=A1");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{7, 3}));
+
+    sheet->ClearCell("B7"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+    sheet->SetCell("C5"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -329,6 +742,853 @@ void TestFormulaIncorrect() {
     ASSERT(isIncorrect("2+4-"));
 }
 
+void TestDependentsInvalidated() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A3"_pos, "=A2*A1");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+// Позиция i-го звена длинной цепочки, уложенной по столбцам
+Position ChainPosition(int index) {
+    return {index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+}
+
+void TestRecalculateLongChain() {
+    constexpr int LENGTH = 50000;
+    Sheet sheet;
+    // Цепочка строится с конца, чтобы каждая формула ссылалась на ещё пустую
+    // ячейку
+    for (int i = LENGTH - 1; i > 0; --i) {
+        sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+    }
+    sheet.SetCell(ChainPosition(0), "1");
+
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell(ChainPosition(LENGTH - 1))->GetValue(),
+                 CellInterface::Value(double(LENGTH)));
+
+    sheet.SetCell(ChainPosition(0), "2");
+    ASSERT_EQUAL(sheet.GetCell(ChainPosition(LENGTH - 1))->GetValue(),
+                 CellInterface::Value(double(LENGTH + 1)));
+}
+
+// Цепочка длиннее, чем позволил бы рекурсивный обход: ленивое вычисление,
+// сброс кэшей и проверка цикла идут по всей её длине
+void TestDeepChainIsStackSafe() {
+    constexpr int LENGTH = 200000;
+    Sheet sheet;
+    sheet.SetCell(ChainPosition(0), "0");
+    for (int i = 1; i < LENGTH; ++i) {
+        sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+    }
+    const Position last = ChainPosition(LENGTH - 1);
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(LENGTH - 1)));
+
+    sheet.SetCell(ChainPosition(0), "1");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(LENGTH)));
+
+    bool caught = false;
+    try {
+        sheet.SetCell(ChainPosition(0), "=" + last.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(LENGTH)));
+}
+
+// Заполняет таблицу связным графом формул (столбцы зависят от соседних) и
+// множеством мелких независимых цепочек
+void FillRecalculationSheet(Sheet& sheet, const std::string& seed) {
+    constexpr int WIDE_COLS = 100;
+    constexpr int WIDE_ROWS = 30;
+    for (int col = 0; col < WIDE_COLS; ++col) {
+        sheet.SetCell({0, col}, seed + std::to_string(col));
+    }
+    for (int row = 1; row < WIDE_ROWS; ++row) {
+        for (int col = 0; col < WIDE_COLS; ++col) {
+            Position up{row - 1, col};
+            Position up_right{row - 1, (col + 1) % WIDE_COLS};
+            sheet.SetCell({row, col}, "=" + up.ToString() + "/3+" + up_right.ToString() + "*0.7");
+        }
+    }
+
+    for (int chain = 0; chain < 400; ++chain) {
+        Position head{WIDE_ROWS + chain, 0};
+        sheet.SetCell(head, std::to_string(chain));
+        for (int col = 1; col < 5; ++col) {
+            Position prev{WIDE_ROWS + chain, col - 1};
+            sheet.SetCell({WIDE_ROWS + chain, col}, "=" + prev.ToString() + "*1.5-" + seed);
+        }
+    }
+}
+
+void TestParallelRecalculationMatches() {
+    Sheet sequential;
+    Sheet parallel;
+    parallel.SetRecalcThreadCount(4);
+    FillRecalculationSheet(sequential, "1");
+    FillRecalculationSheet(parallel, "1");
+
+    auto check_same = [&] {
+        sequential.Recalculate();
+        parallel.Recalculate();
+        std::ostringstream expected;
+        std::ostringstream actual;
+        sequential.PrintValues(expected);
+        parallel.PrintValues(actual);
+        ASSERT_EQUAL(expected.str(), actual.str());
+    };
+    check_same();
+
+    // Повторный пересчёт после массовой правки
+    FillRecalculationSheet(sequential, "2");
+    FillRecalculationSheet(parallel, "2");
+    check_same();
+}
+
+void TestThreadPoolConsecutiveCalls() {
+    // Потоки, ещё не вышедшие из прошлого вызова, забирают отрезки
+    // следующего; каждый вызов должен дождаться ровно своих отрезков
+    ThreadPool pool(8);
+    std::atomic<size_t> total{0};
+    constexpr size_t CALLS = 20000;
+    for (size_t call = 0; call < CALLS; ++call) {
+        pool.ParallelFor(64, 1, [&](size_t begin, size_t end) {
+            total.fetch_add(end - begin, std::memory_order_relaxed);
+        });
+    }
+    ASSERT_EQUAL(total.load(), CALLS * 64);
+}
+
+void TestSetCells() {
+    // Цепочка в обратном порядке, повтор позиции и диапазон: результат как
+    // у последовательных SetCell
+    constexpr int LENGTH = 2000;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int i = LENGTH - 1; i > 0; --i) {
+        cells.emplace_back(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+    }
+    cells.emplace_back(ChainPosition(0), "7");
+    cells.emplace_back("C1"_pos, "text");
+    cells.emplace_back("C1"_pos, "=SUM(A1:A10)");
+    cells.emplace_back("C2"_pos, "'=A1");
+
+    Sheet bulk;
+    bulk.SetCells(cells);
+    Sheet sequential;
+    for (const auto& [pos, text] : cells) {
+        sequential.SetCell(pos, text);
+    }
+    std::ostringstream bulk_values;
+    std::ostringstream sequential_values;
+    bulk.PrintValues(bulk_values);
+    sequential.PrintValues(sequential_values);
+    ASSERT_EQUAL(bulk_values.str(), sequential_values.str());
+    ASSERT_EQUAL(bulk.GetPrintableSize(), sequential.GetPrintableSize());
+    ASSERT_EQUAL(bulk.GetCell("C1"_pos)->GetValue(), CellInterface::Value(115.0));
+
+    Sheet parallel;
+    parallel.SetRecalcThreadCount(4);
+    parallel.SetCells(cells);
+    std::ostringstream parallel_values;
+    parallel.PrintValues(parallel_values);
+    ASSERT_EQUAL(parallel_values.str(), sequential_values.str());
+
+    // После загрузки правки и проверка циклов работают как обычно
+    bulk.SetCell(ChainPosition(0), "0");
+    ASSERT_EQUAL(bulk.GetCell(ChainPosition(LENGTH - 1))->GetValue(),
+                 CellInterface::Value(LENGTH - 1.0));
+    bool caught = false;
+    try {
+        bulk.SetCell(ChainPosition(0), "=" + ChainPosition(LENGTH - 1).ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Все ячейки циклов перечисляются по строкам, лист при этом не меняется.
+    // Цикл через диапазон C1 захватывает звенья цепочки A3:A10.
+    std::vector<Position> cyclic;
+    try {
+        bulk.SetCells({{"E1"_pos, "=F1"},
+                       {"F1"_pos, "=E1+G1"},
+                       {"G1"_pos, "1"},
+                       {"H1"_pos, "=SUM(H1:H2)"},
+                       {"C2"_pos, "=C1"},
+                       {"A3"_pos, "=C2"}});
+    } catch (const CyclicCellsException& e) {
+        cyclic = e.GetCells();
+    }
+    std::vector<Position> expected_cyclic = {"C1"_pos, "E1"_pos, "F1"_pos, "H1"_pos, "C2"_pos};
+    for (int row = 2; row < 10; ++row) {
+        expected_cyclic.push_back({row, 0});
+    }
+    ASSERT_EQUAL(cyclic, expected_cyclic);
+    ASSERT(bulk.GetCell("G1"_pos) == nullptr);
+    ASSERT_EQUAL(bulk.GetCell("C2"_pos)->GetText(), "'=A1");
+    ASSERT_EQUAL(bulk.GetCell("C1"_pos)->GetValue(), CellInterface::Value(45.0));
+    ASSERT_EQUAL(bulk.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Отвергнутый пакет убирает и пустые ячейки, созданные ради его ссылок.
+    // B5 и B50 лежат внутри печатной области, поэтому были бы видны.
+    const Size size = bulk.GetPrintableSize();
+    caught = false;
+    try {
+        bulk.SetCells({{"B1"_pos, "=B2+B5"}, {"B2"_pos, "=B1"}, {"C2"_pos, "=B50*C1"}});
+    } catch (const CyclicCellsException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(bulk.GetPrintableSize(), size);
+    ASSERT(bulk.GetCell("B1"_pos) == nullptr);
+    ASSERT(bulk.GetCell("B5"_pos) == nullptr);
+    ASSERT(bulk.GetCell("B50"_pos) == nullptr);
+    ASSERT_EQUAL(bulk.GetCell("C2"_pos)->GetText(), "'=A1");
+    bulk.SetCell("B5"_pos, "=C1+1");
+    ASSERT_EQUAL(bulk.GetCell("B5"_pos)->GetValue(), CellInterface::Value(46.0));
+    bulk.ClearCell("B5"_pos);
+
+    // Некорректная формула называет свою ячейку
+    std::string message;
+    try {
+        bulk.SetCells({{"E1"_pos, "1"}, {"E2"_pos, "=1+"}});
+    } catch (const FormulaException& e) {
+        message = e.what();
+    }
+    ASSERT(message.rfind("E2: ", 0) == 0);
+    ASSERT(bulk.GetCell("E1"_pos) == nullptr);
+}
+
+void TestSetCellsEmptyBatch() {
+    // Пустой пакет и пустой текст ничего не меняют
+    for (size_t threads : {1, 4}) {
+        Sheet sheet;
+        sheet.SetRecalcThreadCount(threads);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCells({});
+        ImportTexts(sheet, "", '\t', threads);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    }
+}
+
+void TestImportTexts() {
+    Sheet source;
+    source.SetCell("A1"_pos, "=B2*2");
+    source.SetCell("B2"_pos, "21");
+    source.SetCell("C1"_pos, "'=not a formula");
+    source.SetCell("D3"_pos, "=SUM(A1:B2)");
+    source.SetCell("E2"_pos, "text with spaces");
+    std::ostringstream texts;
+    source.PrintTexts(texts);
+
+    // Вывод PrintTexts загружается обратно без потерь, в том числе кусками
+    // на нескольких потоках
+    for (size_t threads : {1, 4}) {
+        Sheet imported;
+        ImportTexts(imported, texts.str(), '\t', threads);
+        std::ostringstream imported_texts;
+        imported.PrintTexts(imported_texts);
+        ASSERT_EQUAL(imported_texts.str(), texts.str());
+        ASSERT_EQUAL(imported.GetCell("D3"_pos)->GetValue(), CellInterface::Value(63.0));
+    }
+
+    // Больше мегабайта данных режется на куски; результат от этого не зависит
+    std::string large;
+    for (int row = 0; row < 5000; ++row) {
+        for (int col = 0; col < 40; ++col) {
+            large += (col > 0 ? "\t" : "") + std::to_string(row * 40 + col);
+        }
+        large += '\n';
+    }
+    ASSERT(TokenizeTexts(large, '\t', 1) == TokenizeTexts(large, '\t', 4));
+    ASSERT_EQUAL(TokenizeTexts(large, '\t', 4).back().first, (Position{4999, 39}));
+
+    // CSV с переводами строк Windows и без завершающего перевода строки
+    auto cells = TokenizeTexts("1,,=A1+1\r\n\r\n,x", ',');
+    ASSERT_EQUAL(cells.size(), 3u);
+    ASSERT_EQUAL(cells[1].first, "C1"_pos);
+    ASSERT_EQUAL(cells[1].second, "=A1+1");
+    ASSERT_EQUAL(cells[2].first, "B3"_pos);
+    ASSERT_EQUAL(cells[2].second, "x");
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_import_test.tsv";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << texts.str();
+    }
+    Sheet from_file;
+    ImportTextsFromFile(from_file, path.string());
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(from_file.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+    bool caught = false;
+    try {
+        ImportTextsFromFile(from_file, path.string());
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestBinarySnapshot() {
+    Sheet source;
+    source.SetCell("A1"_pos, "=B2*2");
+    source.SetCell("B2"_pos, "21");
+    source.SetCell("C1"_pos, "'=not a formula");
+    source.SetCell("C2"_pos, "=1/0");
+    source.SetCell("D3"_pos, "=SUM(A1:B2)+MAX(C1:C2, -X100)");
+    source.SetCell("E1"_pos, "=Z9+1");
+    std::ostringstream image;
+    BinarySnapshot::Save(source, image);
+
+    auto loaded = BinarySnapshot::Load(image.str());
+    std::ostringstream source_texts;
+    std::ostringstream loaded_texts;
+    source.PrintTexts(source_texts);
+    loaded->PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), source_texts.str());
+    ASSERT_EQUAL(loaded->GetPrintableSize(), source.GetPrintableSize());
+
+    // Значения приходят из образа вычисленными
+    const Cell* d3 = loaded->GetConcreteCell("D3"_pos);
+    ASSERT_EQUAL(d3->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(d3->GetReferencedRanges(),
+                 (std::vector<CellRange>{{"A1"_pos, "B2"_pos}, {"C1"_pos, "C2"_pos}}));
+
+    // Граф восстановлен: правки доходят до зависимых, циклы отвергаются
+    loaded->SetCell("C2"_pos, "1");
+    ASSERT_EQUAL(d3->GetValue(), CellInterface::Value(64.0));
+    loaded->SetCell("Z9"_pos, "4");
+    ASSERT_EQUAL(loaded->GetCell("E1"_pos)->GetValue(), CellInterface::Value(5.0));
+    bool caught = false;
+    try {
+        loaded->SetCell("B2"_pos, "=D3");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Через файл, отображённый в память
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+    BinarySnapshot::SaveToFile(*loaded, path.string());
+    auto from_file = BinarySnapshot::LoadFromFile(path.string());
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(from_file->GetCell("D3"_pos)->GetValue(), CellInterface::Value(64.0));
+
+    // Повреждённые образы отвергаются
+    const std::string valid = image.str();
+    for (std::string broken : {valid.substr(0, valid.size() - 1), valid.substr(0, 20),
+                               "X" + valid.substr(1), valid}) {
+        if (broken == valid) {
+            broken[8] = 2;  // версия
+        }
+        caught = false;
+        try {
+            BinarySnapshot::Load(broken);
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    // Две ячейки с одним номером порядка: копируется номер первой записи
+    // во вторую
+    constexpr size_t HEADER_SIZE = 40;
+    constexpr size_t RECORD_SIZE = 40;
+    constexpr size_t ORDER_OFFSET = 8;
+    std::string repeated_order = valid;
+    repeated_order.replace(HEADER_SIZE + RECORD_SIZE + ORDER_OFFSET, sizeof(int64_t),
+                           valid.substr(HEADER_SIZE + ORDER_OFFSET, sizeof(int64_t)));
+    std::string message;
+    try {
+        BinarySnapshot::Load(repeated_order);
+    } catch (const std::runtime_error& e) {
+        message = e.what();
+    }
+    ASSERT(message.find("repeated cell order") != std::string::npos);
+}
+
+void TestSheetSnapshots() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("Z100"_pos, "far");
+    auto first = sheet.TakeSnapshot();
+
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("Z100"_pos);
+    sheet.SetCell("C3"_pos, "=SUM(A1:B1)");
+    auto second = sheet.TakeSnapshot();
+
+    // Старый снимок не видит правок, новый видит их вместе с пересчётом
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->value, CellInterface::Value(2.0));
+    ASSERT_EQUAL(first->GetCell("Z100"_pos)->text, "far");
+    ASSERT(first->GetCell("C3"_pos) == nullptr);
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->value, CellInterface::Value(10.0));
+    ASSERT_EQUAL(second->GetCell("C3"_pos)->value, CellInterface::Value(15.0));
+    ASSERT_EQUAL(second->GetCell("C3"_pos)->text, "=SUM(A1:B1)");
+    ASSERT(second->GetCell("Z100"_pos) == nullptr);
+    ASSERT_EQUAL(second->GetPrintableSize(), (Size{3, 3}));
+    ASSERT_EQUAL(second->GetVersion(), first->GetVersion() + 1);
+
+    std::ostringstream live;
+    std::ostringstream snapshot;
+    sheet.PrintValues(live);
+    second->PrintValues(snapshot);
+    ASSERT_EQUAL(snapshot.str(), live.str());
+
+    // Читатели разбирают снимки в своих потоках, пока лист правится:
+    // в каждом снимке B1 == A1*2 и C1 == B1+1
+    sheet.SetCell("C1"_pos, "=B1+1");
+    std::atomic<bool> done = false;
+    std::shared_ptr<const SheetSnapshot> published = sheet.TakeSnapshot();
+    std::mutex published_mutex;
+    std::atomic<int> violations = 0;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i) {
+        readers.emplace_back([&] {
+            while (!done) {
+                std::shared_ptr<const SheetSnapshot> view;
+                {
+                    std::lock_guard lock(published_mutex);
+                    view = published;
+                }
+                const double a1 = std::stod(view->GetCell("A1"_pos)->text);
+                const double b1 = std::get<double>(view->GetCell("B1"_pos)->value);
+                const double c1 = std::get<double>(view->GetCell("C1"_pos)->value);
+                if (b1 != a1 * 2 || c1 != b1 + 1) {
+                    ++violations;
+                }
+            }
+        });
+    }
+    for (int edit = 0; edit < 2000; ++edit) {
+        sheet.SetCell("A1"_pos, std::to_string(edit));
+        sheet.SetCell({edit % 100 + 10, edit % 7}, std::to_string(edit));
+        if (edit % 10 == 0) {
+            auto view = sheet.TakeSnapshot();
+            std::lock_guard lock(published_mutex);
+            published = std::move(view);
+        }
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(violations.load(), 0);
+}
+
+// Ресурс, который считает невозвращённые байты
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t GetOutstanding() const {
+        return outstanding_;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        outstanding_ += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+        outstanding_ -= bytes;
+        std::pmr::new_delete_resource()->deallocate(memory, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    size_t outstanding_ = 0;
+};
+
+void TestCellContents() {
+    // Короткий текст хранится в ячейке, длинный — в памяти листа; граница
+    // не должна быть заметна снаружи
+    Sheet sheet;
+    const std::string short_text(16, 'x');
+    const std::string long_text(17, 'y');
+    sheet.SetCell("A1"_pos, short_text);
+    sheet.SetCell("A2"_pos, long_text);
+    sheet.SetCell("A3"_pos, "'" + std::string(15, '1'));
+    sheet.SetCell("A4"_pos, "'" + std::string(40, '2'));
+    sheet.SetCell("A5"_pos, "1234567890.12345");
+    sheet.SetCell("A6"_pos, "12345678901234567890.5");
+    sheet.SetCell("B1"_pos, "=A5+A6");
+    sheet.SetCell("B2"_pos, "=A2");
+    sheet.SetCell("B3"_pos, "=SUM(A1:A6)");
+
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), short_text);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(long_text));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(std::string(15, '1')));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "'" + std::string(40, '2'));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(std::string(40, '2')));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(1234567890.12345 + 12345678901234567890.5));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(1234567890.12345 + 12345678901234567890.5));
+
+    // Замена содержимого другого вида освобождает прежнее
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A4"_pos, "=A2*2");
+    sheet.SetCell("A1"_pos, std::string(100, 'z'));
+    sheet.ClearCell("A6"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(1234567890.12345 + 2 + 4));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string(100, 'z'));
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT(texts.str().find("=SUM(A1:A6)") != std::string::npos);
+}
+
+void TestDependencyEdges() {
+    // Формулы переключаются между двумя источниками в случайном порядке:
+    // рёбра удаляются из середины длинных списков зависимых
+    constexpr int FORMULAS = 200;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    std::vector<int> sources(FORMULAS, 3);  // 3 — пустая ячейка
+    std::mt19937 random(7);
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < FORMULAS / 4; ++i) {
+            const int row = static_cast<int>(random() % FORMULAS);
+            const int source = static_cast<int>(random() % 4);
+            const Position pos{row, 1};
+            if (source == 3) {
+                sheet.ClearCell(pos);
+            } else if (source == 2) {
+                sheet.SetCell(pos, "=A1+A2");
+            } else {
+                sheet.SetCell(pos, source == 0 ? "=A1*10" : "=A2*10");
+            }
+            sources[row] = source;
+        }
+        const double a1 = round;
+        const double a2 = round * 3;
+        sheet.SetCell("A1"_pos, std::to_string(round));
+        sheet.SetCell("A2"_pos, std::to_string(round * 3));
+        for (int row = 0; row < FORMULAS; ++row) {
+            const CellInterface* cell = sheet.GetCell({row, 1});
+            if (sources[row] == 3) {
+                ASSERT(cell == nullptr || cell->GetText().empty());
+                continue;
+            }
+            const double expected = sources[row] == 0 ? a1 * 10
+                                  : sources[row] == 1 ? a2 * 10
+                                                      : a1 + a2;
+            ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(expected));
+        }
+    }
+}
+
+void TestPositionsSet() {
+    // Ключи упорядочены как позиции и обратимы
+    ASSERT(("B1"_pos).GetKey() < ("A2"_pos).GetKey());
+    ASSERT(Position::FromKey(("XFD16384"_pos).GetKey()) == "XFD16384"_pos);
+
+    // Случайные вставки и удаления сверяются с std::set; плотный блок
+    // даёт длинные цепочки пробирования, на которых проверяется сдвиг
+    // при удалении
+    PositionsSet positions;
+    std::set<Position> expected;
+    std::mt19937 random(3);
+    for (int i = 0; i < 20000; ++i) {
+        const Position pos{static_cast<int>(random() % 64), static_cast<int>(random() % 64)};
+        if (random() % 3 == 0) {
+            ASSERT_EQUAL(positions.erase(pos), expected.erase(pos));
+        } else {
+            ASSERT_EQUAL(positions.insert(pos), expected.insert(pos).second);
+        }
+        ASSERT_EQUAL(positions.size(), expected.size());
+    }
+    for (int row = 0; row < 64; ++row) {
+        for (int col = 0; col < 64; ++col) {
+            ASSERT_EQUAL(positions.contains({row, col}), expected.count({row, col}) == 1);
+        }
+    }
+    std::vector<Position> listed(positions.begin(), positions.end());
+    std::sort(listed.begin(), listed.end());
+    ASSERT(listed == std::vector<Position>(expected.begin(), expected.end()));
+
+    positions.clear();
+    ASSERT(positions.empty());
+    ASSERT(!positions.contains("A1"_pos));
+    PositionsSet diagonal = {"A1"_pos, "B2"_pos, "C3"_pos, "B2"_pos};
+    ASSERT_EQUAL(diagonal.size(), 3u);
+}
+
+void TestSheetStats() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    if constexpr (!SheetStats::ENABLED) {
+        sheet.GetCell("A3"_pos)->GetValue();
+        ASSERT_EQUAL(sheet.GetStats().cache_misses, 0u);
+        ASSERT_EQUAL(sheet.GetStats().parsed_texts, 0u);
+        return;
+    }
+    ASSERT_EQUAL(sheet.GetStats().parsed_texts, 3u);
+    ASSERT_EQUAL(sheet.GetStats().cycle_checks, 3u);
+
+    // Первое чтение вычисляет A2 и A3; вычисление A3 берёт A2 из кэша
+    sheet.ResetStats();
+    ASSERT_EQUAL(sheet.GetStats().parsed_texts, 0u);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cache_misses, 1u);
+    ASSERT_EQUAL(stats.formula_evaluations, 2u);
+    ASSERT_EQUAL(stats.cache_hits, 2u);
+
+    // Правка сбрасывает оба кэша, цикл отвергается
+    sheet.ResetStats();
+    sheet.SetCell("A1"_pos, "5");
+    try {
+        sheet.SetCell("A1"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.invalidated_caches, 2u);
+    ASSERT_EQUAL(stats.parsed_texts, 2u);
+    ASSERT_EQUAL(stats.cycle_checks, 2u);
+    ASSERT_EQUAL(stats.rejected_cycles, 1u);
+
+    // Пакетная запись проверяет циклы один раз на весь лист
+    sheet.ResetStats();
+    sheet.SetCells({{"B1"_pos, "=A1"}, {"B2"_pos, "=B1"}, {"B3"_pos, "text"}});
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.parsed_texts, 3u);
+    ASSERT_EQUAL(stats.cycle_checks, 1u);
+    ASSERT_EQUAL(stats.rejected_cycles, 0u);
+}
+
+void TestTrace() {
+    Sheet sheet;
+    Trace::Start();
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A1"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+    Trace::Stop();
+    sheet.SetCell("C1"_pos, "not recorded");
+
+    std::ostringstream output;
+    Trace::WriteChromeJson(output);
+    const std::string json = output.str();
+    ASSERT(json.rfind("{\"traceEvents\":[", 0) == 0);
+    if constexpr (!Trace::ENABLED) {
+        ASSERT(json.find("\"ph\"") == std::string::npos);
+        return;
+    }
+    for (const char* name : {"\"Sheet::SetCell\"", "\"Parse\"", "\"Cell::CircularDependency\"",
+                             "\"Cell::NewReference\"", "\"Cell::InvalidCache\"",
+                             "\"Sheet::Evaluate\"", "\"RecalcEngine::Evaluate\""}) {
+        ASSERT(json.find(name) != std::string::npos);
+    }
+    ASSERT(json.find("{\"cell\":\"A1\"}") != std::string::npos);
+    ASSERT(json.find("{\"cell\":\"C1\"}") == std::string::npos);
+    ASSERT_EQUAL(Trace::GetDroppedCount(), 0u);
+
+    // При переполнении остаются последние события
+    Trace::Start();
+    for (size_t i = 0; i < Trace::CAPACITY; ++i) {
+        sheet.SetCell("D1"_pos, std::to_string(i));
+    }
+    Trace::Stop();
+    ASSERT(Trace::GetDroppedCount() > 0);
+    std::ostringstream overflow;
+    Trace::WriteChromeJson(overflow);
+    const std::string events = overflow.str();
+    ASSERT_EQUAL(static_cast<size_t>(std::count(events.begin(), events.end(), '\n')), Trace::CAPACITY + 2);
+
+    // Потоки обгоняют друг друга по кольцу: событие из занятой ячейки
+    // отбрасывается, а выгруженные не смешивают поля разных потоков
+    constexpr int THREADS = 4;
+    Trace::Start();
+    std::vector<std::thread> writers;
+    for (int thread = 0; thread < THREADS; ++thread) {
+        writers.emplace_back([thread] {
+            for (size_t i = 0; i < Trace::CAPACITY; ++i) {
+                Trace::Scope scope("Writer", {thread, 0});
+            }
+        });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+    Trace::Stop();
+    ASSERT(Trace::GetDroppedCount() >= (THREADS - 1) * Trace::CAPACITY);
+    std::ostringstream concurrent;
+    Trace::WriteChromeJson(concurrent);
+    std::istringstream lines(concurrent.str());
+    std::map<std::string, std::string> thread_of_cell;
+    std::set<std::string> threads;
+    for (std::string line; std::getline(lines, line);) {
+        const size_t tid = line.find("\"tid\":");
+        if (tid == std::string::npos) {
+            continue;
+        }
+        ASSERT(line.find("\"Writer\"") != std::string::npos);
+        const std::string thread = line.substr(tid, line.find(',', tid) - tid);
+        const size_t cell_begin = line.find("\"cell\":");
+        const std::string cell = line.substr(cell_begin, line.find('}', cell_begin) - cell_begin);
+        const auto [it, inserted] = thread_of_cell.emplace(cell, thread);
+        ASSERT_EQUAL(it->second, thread);
+        threads.insert(thread);
+    }
+    ASSERT_EQUAL(threads.size(), thread_of_cell.size());
+}
+
+void TestConstantFolding() {
+    auto eval_size = [](const std::string& expression) {
+        return ParseFormulaAST(expression).GetEvalProgram().size();
+    };
+    ASSERT_EQUAL(eval_size("--5+2*3"), 1u);
+    ASSERT_EQUAL(eval_size("A1*(1/3600)*24"), 5u);
+    ASSERT_EQUAL(eval_size("-(-A1)"), 1u);
+    ASSERT_EQUAL(eval_size("+A1-+2"), 3u);
+    ASSERT_EQUAL(eval_size("SUM(1,2,3)*A1"), 3u);
+    ASSERT_EQUAL(eval_size("SUM(A1:B2,1+2)"), 3u);
+    // Без констант исполняется исходная программа, ошибки не сворачиваются
+    const FormulaAST plain = ParseFormulaAST("A1+B1*2");
+    ASSERT(&plain.GetEvalProgram() == &plain.GetProgram());
+    ASSERT_EQUAL(eval_size("1/0"), 3u);
+    ASSERT_EQUAL(eval_size("1e308*10+A1"), 5u);
+    ASSERT_EQUAL(eval_size("AVERAGE(2-2-0)"), 1u);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3600");
+    sheet.SetCell("B1"_pos, "text");
+    const std::vector<std::pair<std::string, CellInterface::Value>> cases = {
+        {"=--5+2*3", 11.0},
+        {"=A1*(1/3600)*24", 3600 * (1.0 / 3600) * 24},
+        {"=-(-A1)/-+2", -1800.0},
+        {"=SUM(1,2,3)*A1", 21600.0},
+        {"=MIN(4,-(1/4))+A1", 3599.75},
+        {"=1/0", FormulaError(FormulaError::Category::Arithmetic)},
+        {"=1e308*10+A1", FormulaError(FormulaError::Category::Arithmetic)},
+        {"=AVERAGE(2-2-0)+MAX(A1)", 3600.0},
+        // Ошибки приходят в прежнем порядке: ссылка раньше деления
+        {"=B1+1/0", FormulaError(FormulaError::Category::Value)},
+        {"=1/0+B1", FormulaError(FormulaError::Category::Arithmetic)},
+    };
+    for (const auto& [text, expected] : cases) {
+        sheet.SetCell("C1"_pos, text);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), expected);
+    }
+
+    // Выражение печатается по исходной программе
+    ASSERT_EQUAL(ParseFormula("--5+2*3")->GetExpression(), "--5+2*3");
+    ASSERT_EQUAL(ParseFormula("-(-A1)/-+2")->GetExpression(), "--A1/-+2");
+    ASSERT_EQUAL(ParseFormula("SUM(1,2,3)*A1")->GetExpression(), "SUM(1,2,3)*A1");
+}
+
+void TestMemoryPool() {
+    CountingResource resource;
+    {
+        // Формула целиком, вместе с программой и списком ячеек, живёт в
+        // переданном ресурсе и возвращает ему всю память
+        auto formula = ParseFormula("A1+SUM(B1:B3)*2", &resource);
+        ASSERT(resource.GetOutstanding() > 0);
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B2"_pos, "3");
+        ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 7.0);
+        ASSERT_EQUAL(formula->GetExpression(), "A1+SUM(B1:B3)*2");
+
+        PoolPtr<FormulaInterface> moved = std::move(formula);
+        moved.reset();
+        ASSERT_EQUAL(resource.GetOutstanding(), 0u);
+
+        // Без ресурса PoolPtr удаляет объект обычным delete
+        PoolPtr<FormulaInterface> adopted(ParseFormula("1+2").release());
+        ASSERT_EQUAL(std::get<double>(adopted->Evaluate(*sheet)), 3.0);
+    }
+
+    // Содержимое и рёбра ячеек переиспользуют память листа при правках
+    Sheet sheet;
+    for (int round = 0; round < 3; ++round) {
+        for (int row = 0; row < 100; ++row) {
+            const Position pos{row, 1};
+            sheet.SetCell(pos, row == 0 ? "1" : "=" + Position{row - 1, 1}.ToString() + "+A1");
+        }
+        sheet.SetCell("A1"_pos, std::to_string(round));
+        ASSERT_EQUAL(sheet.GetCell({99, 1})->GetValue(),
+                     CellInterface::Value(1.0 + 99.0 * round));
+        for (int row = 0; row < 100; row += 2) {
+            sheet.ClearCell({row, 1});
+        }
+    }
+}
+
+void TestConcurrentReads() {
+    // Сетка, где каждая формула зависит от соседей слева и сверху: потоки
+    // читают перекрывающиеся части графа с холодным кэшем
+    constexpr int SIZE = 40;
+    constexpr int THREADS = 4;
+    Sheet sheet;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            std::string text = "=1";
+            if (row > 0) {
+                text += "+" + Position{row - 1, col}.ToString() + "/2";
+            }
+            if (col > 0) {
+                text += "+" + Position{row, col - 1}.ToString() + "/3";
+            }
+            sheet.SetCell({row, col}, text);
+        }
+    }
+    sheet.Recalculate();
+    std::vector<CellInterface::Value> expected;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            expected.push_back(sheet.GetCell({row, col})->GetValue());
+        }
+    }
+
+    for (int round = 0; round < 20; ++round) {
+        sheet.SetCell("A1"_pos, "=1");  // все кэши снова устарели
+        std::atomic<int> mismatches = 0;
+        std::vector<std::thread> readers;
+        for (int thread = 0; thread < THREADS; ++thread) {
+            readers.emplace_back([&, thread] {
+                std::mt19937 random(round * THREADS + thread);
+                for (int read = 0; read < SIZE * SIZE; ++read) {
+                    const int index = static_cast<int>(random() % (SIZE * SIZE));
+                    const Position pos{index / SIZE, index % SIZE};
+                    if (!(sheet.GetCell(pos)->GetValue() == expected[index])) {
+                        ++mismatches;
+                    }
+                }
+            });
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        ASSERT_EQUAL(mismatches.load(), 0);
+    }
+}
+
 void TestCellCircularReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "=E4");
@@ -347,6 +1607,63 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+// Достижима ли target из from по ссылкам формул — проверка полным обходом
+bool IsReachable(const SheetInterface& sheet, Position from, Position target) {
+    std::vector<Position> stack = {from};
+    std::set<Position> visited = {from};
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        if (pos == target) {
+            return true;
+        }
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (!cell) {
+            continue;
+        }
+        for (Position ref : cell->GetReferencedCells()) {
+            if (visited.insert(ref).second) {
+                stack.push_back(ref);
+            }
+        }
+    }
+    return false;
+}
+
+void TestCircularReferencesRandomEdits() {
+    constexpr int SIDE = 6;
+    auto sheet = CreateSheet();
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> coord(0, SIDE - 1);
+    auto random_position = [&] {
+        return Position{coord(random), coord(random)};
+    };
+
+    // Случайные правки перемешивают порядок ячеек, и каждая попытка
+    // сверяется с полным обходом графа ссылок
+    for (int edit = 0; edit < 3000; ++edit) {
+        Position pos = random_position();
+        Position lhs = random_position();
+        Position rhs = random_position();
+        std::string text = edit % 7 == 0 ? "1" : "=" + lhs.ToString() + "+" + rhs.ToString();
+        bool expected = text != "1" && (IsReachable(*sheet, lhs, pos) || IsReachable(*sheet, rhs, pos));
+
+        const CellInterface* before = sheet->GetCell(pos);
+        std::string old_text = before ? before->GetText() : "";
+        bool caught = false;
+        try {
+            sheet->SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        AssertEqual(caught, expected, "edit " + std::to_string(edit) + ": " + pos.ToString() + text);
+        if (caught) {
+            const CellInterface* after = sheet->GetCell(pos);
+            AssertEqual(after ? after->GetText() : "", old_text, "cell text after rejected edit");
+        }
+    }
+}
 }  // namespace
 
 int main() {
@@ -361,13 +1678,42 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaExpressionParentheses);
+    RUN_TEST(tr, TestFormulaDeepNesting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaParsersAgree);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
+    RUN_TEST(tr, TestErrorPropagation);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestRangeErrorOrder);
+    RUN_TEST(tr, TestTextCellNumericValue);
+    RUN_TEST(tr, TestFormulaRanges);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestRangeIndex);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintableSizeShrinks);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesRandomEdits);
+    RUN_TEST(tr, TestDependentsInvalidated);
+    RUN_TEST(tr, TestRecalculateLongChain);
+    RUN_TEST(tr, TestDeepChainIsStackSafe);
+    RUN_TEST(tr, TestParallelRecalculationMatches);
+    RUN_TEST(tr, TestThreadPoolConsecutiveCalls);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSetCellsEmptyBatch);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestBinarySnapshot);
+    RUN_TEST(tr, TestSheetSnapshots);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestMemoryPool);
+    RUN_TEST(tr, TestCellContents);
+    RUN_TEST(tr, TestDependencyEdges);
+    RUN_TEST(tr, TestPositionsSet);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestTrace);
+    RUN_TEST(tr, TestConstantFolding);
 }
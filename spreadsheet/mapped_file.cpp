@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_HAS_MMAP 1
+#endif
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef SPREADSHEET_HAS_MMAP
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("MappedFile: cannot open " + path);
+  }
+  struct stat info {};
+  if (::fstat(fd, &info) != 0) {
+    ::close(fd);
+    throw std::runtime_error("MappedFile: cannot stat " + path);
+  }
+  size_ = static_cast<size_t>(info.st_size);
+  if (size_ > 0) {
+    void *address = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("MappedFile: cannot map " + path);
+    }
+    data_ = static_cast<const char *>(address);
+    // Файл читается один раз подряд
+    ::madvise(address, size_, MADV_SEQUENTIAL);
+  }
+  ::close(fd);
+#else
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    throw std::runtime_error("MappedFile: cannot open " + path);
+  }
+  buffer_.assign(std::istreambuf_iterator<char>(input),
+                 std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef SPREADSHEET_HAS_MMAP
+  if (size_ > 0) {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+#endif
+}
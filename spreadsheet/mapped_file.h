@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Файл, отображённый в память только для чтения. Где отображения нет
+// (не POSIX), содержимое читается в буфер. Если файл не открывается,
+// конструктор бросает std::runtime_error.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    std::string_view GetData() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string buffer_;  // содержимое, если отображение недоступно
+};
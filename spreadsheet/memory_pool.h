@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Пул памяти для множества мелких объектов одного владельца. Без
+// синхронизации: выделения из нескольких потоков разрешены только на время
+// жизни SharedScope, тогда они идут под мьютексом. Вся память возвращается
+// при уничтожении пула крупными блоками.
+class MemoryPool final : public std::pmr::memory_resource {
+public:
+    class SharedScope {
+    public:
+        explicit SharedScope(MemoryPool& pool) : pool_(pool) {
+            pool_.shared_ = true;
+        }
+        ~SharedScope() {
+            pool_.shared_ = false;
+        }
+        SharedScope(const SharedScope&) = delete;
+        SharedScope& operator=(const SharedScope&) = delete;
+
+    private:
+        MemoryPool& pool_;
+    };
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (shared_) {
+            std::lock_guard lock(mutex_);
+            return pool_.allocate(bytes, alignment);
+        }
+        return pool_.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+        if (shared_) {
+            std::lock_guard lock(mutex_);
+            pool_.deallocate(memory, bytes, alignment);
+            return;
+        }
+        pool_.deallocate(memory, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::unsynchronized_pool_resource pool_;
+    std::mutex mutex_;
+    bool shared_ = false;
+};
+
+// Удаляет объект, созданный MakePooled, и возвращает память ресурсу, из
+// которого она взята. Размер запоминается при создании, поэтому объект
+// можно удалять через указатель на базовый класс с виртуальным
+// деструктором. Без ресурса удаляет объект обычным delete — так PoolPtr
+// принимает и объекты, созданные new.
+class PoolDeleter {
+public:
+    PoolDeleter() = default;
+    PoolDeleter(std::pmr::memory_resource* resource, size_t size, size_t alignment)
+        : resource_(resource),
+          size_(static_cast<uint32_t>(size)),
+          alignment_(static_cast<uint32_t>(alignment)) {
+    }
+
+    std::pmr::memory_resource* GetResource() const {
+        return resource_;
+    }
+    size_t GetSize() const {
+        return size_;
+    }
+    size_t GetAlignment() const {
+        return alignment_;
+    }
+
+    template <typename T>
+    void operator()(T* object) const {
+        if (!resource_) {
+            delete object;
+            return;
+        }
+        object->~T();
+        resource_->deallocate(object, size_, alignment_);
+    }
+
+private:
+    std::pmr::memory_resource* resource_ = nullptr;
+    uint32_t size_ = 0;
+    uint32_t alignment_ = 0;
+};
+
+template <typename T>
+using PoolPtr = std::unique_ptr<T, PoolDeleter>;
+
+// Создаёт объект в памяти resource
+template <typename T, typename... Args>
+PoolPtr<T> MakePooled(std::pmr::memory_resource* resource, Args&&... args) {
+    void* memory = resource->allocate(sizeof(T), alignof(T));
+    try {
+        return PoolPtr<T>(new (memory) T(std::forward<Args>(args)...),
+                          PoolDeleter(resource, sizeof(T), alignof(T)));
+    } catch (...) {
+        resource->deallocate(memory, sizeof(T), alignof(T));
+        throw;
+    }
+}
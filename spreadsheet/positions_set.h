@@ -0,0 +1,198 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+
+// Множество позиций в плоской таблице с открытой адресацией: ключи
+// (Position::GetKey) лежат прямо в массиве, поиск — линейное пробирование
+// без выделений памяти и переходов по указателям. Таблица заполняется не
+// больше чем наполовину, удаление сдвигает следующие ключи назад, так что
+// надгробий нет. Интерфейс повторяет нужную часть std::unordered_set.
+class PositionsSet {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Position;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Position*;
+        using reference = Position;
+
+        Position operator*() const {
+            return Position::FromKey(*slot_);
+        }
+
+        const_iterator& operator++() {
+            ++slot_;
+            SkipEmpty();
+            return *this;
+        }
+
+        bool operator==(const const_iterator& rhs) const {
+            return slot_ == rhs.slot_;
+        }
+
+        bool operator!=(const const_iterator& rhs) const {
+            return slot_ != rhs.slot_;
+        }
+
+    private:
+        friend class PositionsSet;
+
+        const_iterator(const uint64_t* slot, const uint64_t* end) : slot_(slot), end_(end) {
+            SkipEmpty();
+        }
+
+        void SkipEmpty() {
+            while (slot_ != end_ && *slot_ == EMPTY) {
+                ++slot_;
+            }
+        }
+
+        const uint64_t* slot_;
+        const uint64_t* end_;
+    };
+
+    PositionsSet() = default;
+
+    template <typename Iterator>
+    PositionsSet(Iterator first, Iterator last) {
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+
+    PositionsSet(std::initializer_list<Position> positions)
+        : PositionsSet(positions.begin(), positions.end()) {
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const_iterator begin() const {
+        return {slots_.data(), slots_.data() + slots_.size()};
+    }
+
+    const_iterator end() const {
+        return {slots_.data() + slots_.size(), slots_.data() + slots_.size()};
+    }
+
+    // Добавляет позицию; false, если она уже была
+    bool insert(Position pos) {
+        const uint64_t key = pos.GetKey();
+        assert(key != EMPTY);
+        if ((size_ + 1) * 2 > slots_.size()) {
+            Rehash(std::max<size_t>(MIN_CAPACITY, slots_.size() * 2));
+        }
+        size_t slot = Home(key);
+        while (slots_[slot] != EMPTY) {
+            if (slots_[slot] == key) {
+                return false;
+            }
+            slot = (slot + 1) & mask_;
+        }
+        slots_[slot] = key;
+        ++size_;
+        return true;
+    }
+
+    bool contains(Position pos) const {
+        return Find(pos.GetKey()) != NOT_FOUND;
+    }
+
+    size_t count(Position pos) const {
+        return contains(pos) ? 1 : 0;
+    }
+
+    size_t erase(Position pos) {
+        size_t hole = Find(pos.GetKey());
+        if (hole == NOT_FOUND) {
+            return 0;
+        }
+        // Ключи за дыркой, которые в неё пробировались, сдвигаются назад
+        for (size_t slot = (hole + 1) & mask_; slots_[slot] != EMPTY; slot = (slot + 1) & mask_) {
+            const size_t home = Home(slots_[slot]);
+            if (((slot - home) & mask_) >= ((slot - hole) & mask_)) {
+                slots_[hole] = slots_[slot];
+                hole = slot;
+            }
+        }
+        slots_[hole] = EMPTY;
+        --size_;
+        return 1;
+    }
+
+    // Память таблицы остаётся за множеством
+    void clear() {
+        std::fill(slots_.begin(), slots_.end(), EMPTY);
+        size_ = 0;
+    }
+
+    void reserve(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity < count * 2) {
+            capacity *= 2;
+        }
+        if (capacity > slots_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+private:
+    // Position::NONE; у допустимых позиций такого ключа не бывает
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    size_t Home(uint64_t key) const {
+        // Старшие биты произведения перемешаны лучше младших
+        return static_cast<size_t>((key * PositionHasher::MULTIPLIER) >> shift_);
+    }
+
+    size_t Find(uint64_t key) const {
+        if (size_ == 0) {
+            return NOT_FOUND;
+        }
+        for (size_t slot = Home(key); slots_[slot] != EMPTY; slot = (slot + 1) & mask_) {
+            if (slots_[slot] == key) {
+                return slot;
+            }
+        }
+        return NOT_FOUND;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<uint64_t> old_slots(capacity, EMPTY);
+        old_slots.swap(slots_);
+        mask_ = capacity - 1;
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c /= 2) {
+            --shift_;
+        }
+        for (uint64_t key : old_slots) {
+            if (key != EMPTY) {
+                size_t slot = Home(key);
+                while (slots_[slot] != EMPTY) {
+                    slot = (slot + 1) & mask_;
+                }
+                slots_[slot] = key;
+            }
+        }
+    }
+
+    std::vector<uint64_t> slots_;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    int shift_ = 64;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Индекс прямоугольных зависимостей: для позиции ячейки находит владельцев
+// (формулы) диапазонов, которые её покрывают, не заводя записи на каждую
+// ячейку диапазона.
+//
+// Двумерное дерево отрезков. Внешнее дерево — по строкам: диапазон
+// раскладывается на O(log MAX_ROWS) узлов, чьи отрезки строк он покрывает
+// целиком. У каждого такого узла своё дерево по столбцам, в котором отрезок
+// столбцов диапазона так же раскладывается на O(log MAX_COLS) узлов с
+// владельцами. Запрос спускается к листу строки и на каждом узле пути — к
+// листу столбца, поэтому стоит O(log MAX_ROWS * log MAX_COLS + ответ)
+// независимо от числа диапазонов на тех же строках. Узлы создаются по мере
+// вставки, а опустевшие после удаления освобождаются и идут под следующие
+// вставки, поэтому память пропорциональна числу диапазонов в индексе, а не
+// их площади или числу когда-либо вставленных.
+template <typename Owner>
+class RangeIndex {
+public:
+    void Insert(CellRange range, Owner owner) {
+        if (row_root_ == NO_NODE) {
+            row_root_ = rows_.Allocate();
+        }
+        ForEachCanonical(rows_, row_root_, Position::MAX_ROWS, range.first.row, range.last.row,
+                         [&](int32_t row_node) {
+                             int32_t columns = rows_.nodes[row_node].columns;
+                             if (columns == NO_NODE) {
+                                 columns = columns_.Allocate();
+                                 rows_.nodes[row_node].columns = columns;
+                             }
+                             ForEachCanonical(columns_, columns, Position::MAX_COLS, range.first.col,
+                                              range.last.col, [&](int32_t column_node) {
+                                                  columns_.nodes[column_node].owners.push_back(owner);
+                                              });
+                         });
+        ++size_;
+    }
+
+    // Удаляет одну запись, добавленную Insert с теми же аргументами, и
+    // освобождает узлы, в поддеревьях которых не осталось владельцев
+    void Erase(CellRange range, Owner owner) {
+        if (row_root_ == NO_NODE) {
+            return;
+        }
+        auto erase_columns = [&](int32_t row_node) {
+            const int32_t columns = rows_.nodes[row_node].columns;
+            if (columns == NO_NODE) {
+                return;
+            }
+            auto erase_owner = [&](int32_t column_node) {
+                EraseOne(columns_.nodes[column_node].owners, owner);
+            };
+            if (Prune(columns_, columns, 0, Position::MAX_COLS, range.first.col, range.last.col,
+                      erase_owner)) {
+                rows_.nodes[row_node].columns = NO_NODE;
+            }
+        };
+        if (Prune(rows_, row_root_, 0, Position::MAX_ROWS, range.first.row, range.last.row,
+                  erase_columns)) {
+            row_root_ = NO_NODE;
+        }
+        --size_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Число занятых узлов обоих деревьев
+    size_t NodeCount() const {
+        return rows_.Count() + columns_.Count();
+    }
+
+    // Вызывает visitor(owner) для каждого диапазона, покрывающего pos.
+    // Владелец нескольких покрывающих диапазонов встречается несколько раз.
+    template <typename Visitor>
+    void ForEachCovering(Position pos, Visitor&& visitor) const {
+        VisitCovering(pos, [&visitor](const Owner& owner) {
+            visitor(owner);
+            return true;
+        });
+    }
+
+    // Останавливается на первом покрывающем диапазоне
+    bool Covers(Position pos) const {
+        return !VisitCovering(pos, [](const Owner&) {
+            return false;
+        });
+    }
+
+private:
+    static constexpr int32_t NO_NODE = -1;
+
+    // Узел дерева по строкам использует columns — корень своего дерева по
+    // столбцам, узел дерева по столбцам — owners
+    struct Node {
+        std::array<int32_t, 2> children = {NO_NODE, NO_NODE};
+        int32_t columns = NO_NODE;
+        std::vector<Owner> owners;
+
+        bool IsEmpty() const {
+            return children[0] == NO_NODE && children[1] == NO_NODE && columns == NO_NODE &&
+                   owners.empty();
+        }
+    };
+
+    // Узлы дерева и список освободившихся номеров
+    struct Tree {
+        std::vector<Node> nodes;
+        std::vector<int32_t> free;
+
+        // Ссылки на узлы после этого недействительны
+        int32_t Allocate() {
+            if (!free.empty()) {
+                const int32_t node = free.back();
+                free.pop_back();
+                return node;
+            }
+            nodes.emplace_back();
+            return static_cast<int32_t>(nodes.size() - 1);
+        }
+
+        void Free(int32_t node) {
+            nodes[node] = Node{};
+            free.push_back(node);
+        }
+
+        size_t Count() const {
+            return nodes.size() - free.size();
+        }
+    };
+
+    // Спускается к листу pos и вызывает visitor(owner), пока тот возвращает
+    // true. Возвращает false, если visitor остановил обход.
+    template <typename Visitor>
+    bool VisitCovering(Position pos, Visitor&& visitor) const {
+        if (size_ == 0) {
+            return true;
+        }
+        for (int32_t row_node : Path(rows_, row_root_, Position::MAX_ROWS, pos.row)) {
+            const int32_t columns = rows_.nodes[row_node].columns;
+            if (columns == NO_NODE) {
+                continue;
+            }
+            for (int32_t column_node : Path(columns_, columns, Position::MAX_COLS, pos.col)) {
+                for (const Owner& owner : columns_.nodes[column_node].owners) {
+                    if (!visitor(owner)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Существующие узлы на пути от корня к листу; глубина дерева не больше
+    // log2(limit) + 1, так что путь помещается в массив
+    static constexpr size_t MAX_DEPTH = 16;
+    static_assert(Position::MAX_ROWS <= 1 << (MAX_DEPTH - 1) && Position::MAX_COLS <= 1 << (MAX_DEPTH - 1));
+
+    class PathNodes {
+    public:
+        const int32_t* begin() const {
+            return nodes_.data();
+        }
+        const int32_t* end() const {
+            return nodes_.data() + size_;
+        }
+        void Push(int32_t node) {
+            nodes_[size_++] = node;
+        }
+
+    private:
+        std::array<int32_t, MAX_DEPTH> nodes_;
+        size_t size_ = 0;
+    };
+
+    static PathNodes Path(const Tree& tree, int32_t root, int limit, int coordinate) {
+        PathNodes path;
+        int32_t node = root;
+        int begin = 0;
+        int end = limit;
+        while (node != NO_NODE) {
+            path.Push(node);
+            if (end - begin == 1) {
+                break;
+            }
+            const int middle = begin + (end - begin) / 2;
+            const bool right = coordinate >= middle;
+            (right ? begin : end) = middle;
+            node = tree.nodes[node].children[right];
+        }
+        return path;
+    }
+
+    // Вызывает on_node для узлов дерева над [0, limit) с корнем root, чьи
+    // отрезки [first, last] покрывает целиком, создавая недостающие. Обход с
+    // явным стеком; on_node может добавлять узлы, поэтому ссылки на узлы
+    // между вызовами не хранятся.
+    template <typename OnNode>
+    static void ForEachCanonical(Tree& tree, int32_t root, int limit, int first, int last, OnNode&& on_node) {
+        struct Frame {
+            int32_t node;
+            int begin;
+            int end;
+        };
+        std::vector<Frame> stack = {{root, 0, limit}};
+        while (!stack.empty()) {
+            auto [node, begin, end] = stack.back();
+            stack.pop_back();
+
+            if (first <= begin && end - 1 <= last) {
+                on_node(node);
+                continue;
+            }
+
+            const int middle = begin + (end - begin) / 2;
+            for (int right = 0; right < 2; ++right) {
+                const int child_begin = right ? middle : begin;
+                const int child_end = right ? end : middle;
+                if (last < child_begin || child_end - 1 < first) {
+                    continue;
+                }
+                int32_t child = tree.nodes[node].children[right];
+                if (child == NO_NODE) {
+                    child = tree.Allocate();
+                    tree.nodes[node].children[right] = child;
+                }
+                stack.push_back({child, child_begin, child_end});
+            }
+        }
+    }
+
+    // Вызывает on_node для узлов разложения [first, last] в поддереве node
+    // над [begin, end) и на обратном пути освобождает опустевшие узлы.
+    // Возвращает true, если освобождён сам node. Рекурсия не глубже
+    // MAX_DEPTH.
+    template <typename OnNode>
+    static bool Prune(Tree& tree, int32_t node, int begin, int end, int first, int last, OnNode& on_node) {
+        if (first <= begin && end - 1 <= last) {
+            on_node(node);
+        } else {
+            const int middle = begin + (end - begin) / 2;
+            for (int right = 0; right < 2; ++right) {
+                const int child_begin = right ? middle : begin;
+                const int child_end = right ? end : middle;
+                const int32_t child = tree.nodes[node].children[right];
+                if (child == NO_NODE || last < child_begin || child_end - 1 < first) {
+                    continue;
+                }
+                if (Prune(tree, child, child_begin, child_end, first, last, on_node)) {
+                    tree.nodes[node].children[right] = NO_NODE;
+                }
+            }
+        }
+        if (!tree.nodes[node].IsEmpty()) {
+            return false;
+        }
+        tree.Free(node);
+        return true;
+    }
+
+    // В узле лежат только владельцы диапазонов с тем же куском разложения,
+    // так что поиск идёт среди них, а не среди всех диапазонов на строках
+    static void EraseOne(std::vector<Owner>& owners, const Owner& owner) {
+        for (size_t i = 0; i < owners.size(); ++i) {
+            if (owners[i] == owner) {
+                owners[i] = std::move(owners.back());
+                owners.pop_back();
+                return;
+            }
+        }
+    }
+
+    Tree rows_;
+    Tree columns_;
+    int32_t row_root_ = NO_NODE;
+    size_t size_ = 0;
+};
@@ -0,0 +1,198 @@
+#include "recalc_engine.h"
+
+#include "cell.h"
+#include "sheet.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+
+void RecalcEngine::SetThreadCount(size_t thread_count) {
+  if (thread_count <= 1) {
+    pool_.reset();
+  } else if (thread_count != GetThreadCount()) {
+    pool_ = std::make_unique<ThreadPool>(thread_count);
+  }
+}
+
+size_t RecalcEngine::GetThreadCount() const {
+  return pool_ ? pool_->GetThreadCount() : 1;
+}
+
+bool RecalcEngine::IsDirty(const Cell *cell) {
+  return !cell->content_.IsCacheValid();
+}
+
+void RecalcEngine::Compute(const Cell *cell) {
+  // Все влияющие ячейки уже вычислены, поэтому вычисление формулы
+  // берёт их значения из кэша и не уходит в рекурсию
+  cell->sheet_.GetStatsCounters().Add(SheetStatsCounters::FORMULA_EVALUATIONS);
+  cell->content_.GetNumericValue(cell->sheet_);
+}
+
+void RecalcEngine::Evaluate(const std::vector<const Cell *> &roots,
+                            uint32_t epoch) {
+  Trace::Scope trace("RecalcEngine::Evaluate");
+  auto order = CollectInTopologicalOrder(roots, epoch);
+  if (!pool_ || order.size() < MIN_PARALLEL_CELLS) {
+    for (const Cell *cell : order) {
+      Compute(cell);
+    }
+    return;
+  }
+  EvaluateInParallel(order);
+}
+
+void RecalcEngine::ParallelFor(
+    size_t count, size_t grain,
+    const std::function<void(size_t, size_t)> &body) {
+  if (!pool_ || count <= grain) {
+    body(0, count);
+    return;
+  }
+  pool_->ParallelFor(count, grain, body);
+}
+
+void RecalcEngine::EvaluateInParallel(const std::vector<const Cell *> &order) {
+  Trace::Scope trace("RecalcEngine::EvaluateInParallel");
+  const size_t count = order.size();
+  std::unordered_map<const Cell *, size_t> index;
+  index.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    index.emplace(order[i], i);
+  }
+
+  // Компоненты связности (система непересекающихся множеств) и уровни:
+  // уровень формулы на единицу больше наибольшего уровня её устаревших
+  // влияющих ячеек. В топологическом порядке уровни влияющих уже известны.
+  std::vector<size_t> parent(count);
+  std::iota(parent.begin(), parent.end(), 0);
+  auto find_root = [&parent](size_t i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  };
+  std::vector<size_t> levels(count, 0);
+  for (size_t i = 0; i < count; ++i) {
+    order[i]->ForEachReferenced([&](const Cell *reference) {
+      auto it = index.find(reference);
+      if (it == index.end()) {
+        return;
+      }
+      size_t j = it->second;
+      levels[i] = std::max(levels[i], levels[j] + 1);
+      parent[find_root(i)] = find_root(j);
+    });
+  }
+
+  // Ячейки каждой компоненты в топологическом порядке
+  std::unordered_map<size_t, size_t> component_ids;
+  std::vector<std::vector<size_t>> components;
+  for (size_t i = 0; i < count; ++i) {
+    auto [it, inserted] =
+        component_ids.emplace(find_root(i), components.size());
+    if (inserted) {
+      components.emplace_back();
+    }
+    components[it->second].push_back(i);
+  }
+
+  const size_t threads = pool_->GetThreadCount();
+  const size_t large_size =
+      std::max(MIN_PARALLEL_CELLS, count / (2 * threads));
+  std::vector<const std::vector<size_t> *> small_components;
+  for (const auto &component : components) {
+    if (component.size() < large_size) {
+      small_components.push_back(&component);
+    }
+  }
+
+  pool_->ParallelFor(small_components.size(),
+                     small_components.size() / (4 * threads) + 1,
+                     [&](size_t begin, size_t end) {
+                       for (size_t c = begin; c < end; ++c) {
+                         for (size_t i : *small_components[c]) {
+                           Compute(order[i]);
+                         }
+                       }
+                     });
+
+  for (const auto &component : components) {
+    if (component.size() >= large_size) {
+      EvaluateByLevels(order, component, levels);
+    }
+  }
+}
+
+void RecalcEngine::EvaluateByLevels(const std::vector<const Cell *> &order,
+                                    const std::vector<size_t> &component,
+                                    const std::vector<size_t> &levels) {
+  std::vector<std::vector<const Cell *>> by_level;
+  for (size_t i : component) {
+    if (levels[i] >= by_level.size()) {
+      by_level.resize(levels[i] + 1);
+    }
+    by_level[levels[i]].push_back(order[i]);
+  }
+
+  const size_t threads = pool_->GetThreadCount();
+  for (const auto &level : by_level) {
+    if (level.size() < MIN_PARALLEL_LEVEL) {
+      for (const Cell *cell : level) {
+        Compute(cell);
+      }
+      continue;
+    }
+    pool_->ParallelFor(level.size(), level.size() / (4 * threads) + 1,
+                       [&level](size_t begin, size_t end) {
+                         for (size_t i = begin; i < end; ++i) {
+                           Compute(level[i]);
+                         }
+                       });
+  }
+}
+
+std::vector<const Cell *> RecalcEngine::CollectInTopologicalOrder(
+    const std::vector<const Cell *> &roots, uint32_t epoch) const {
+  // Обход в глубину с явным стеком: ячейка попадает в order после всех
+  // своих устаревших влияющих ячеек. Влияющие ячейки кладутся в стек разом,
+  // поэтому одна ячейка может оказаться в нём несколько раз; раскрывается
+  // только первая из встреченных копий, остальные пропускаются.
+  struct Entry {
+    const Cell *cell;
+    bool expanded;
+  };
+
+  std::vector<const Cell *> order;
+  std::vector<Entry> stack;
+
+  for (const Cell *root : roots) {
+    if (IsDirty(root)) {
+      stack.push_back({root, false});
+    }
+
+    while (!stack.empty()) {
+      Entry entry = stack.back();
+      stack.pop_back();
+      if (entry.expanded) {
+        order.push_back(entry.cell);
+        continue;
+      }
+      if (!entry.cell->Visit(epoch)) {
+        continue;
+      }
+
+      stack.push_back({entry.cell, true});
+      entry.cell->ForEachReferenced([&stack, epoch](const Cell *reference) {
+        if (IsDirty(reference) && reference->visit_epoch_ != epoch) {
+          stack.push_back({reference, false});
+        }
+      });
+    }
+  }
+  return order;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class Cell;
+
+// Пересчёт формул без рекурсии. Устаревшие формулы собираются обходом графа
+// зависимостей, хранящегося в ячейках, упорядочиваются топологически
+// (влияющие раньше зависимых) и вычисляются по одному разу.
+//
+// Если разрешено несколько потоков, устаревшая часть графа делится на
+// независимые компоненты связности: небольшие компоненты вычисляются целиком
+// параллельно друг другу, а крупные — по топологическим уровням, внутри
+// которых формулы друг от друга не зависят. Каждая ячейка пишет только свой
+// кэш и читает кэши уже завершённых уровней; завершение уровня (ожидание в
+// ThreadPool::ParallelFor) публикует записанные значения для следующего.
+// Поэтому результат совпадает с однопоточным вычислением.
+class RecalcEngine {
+public:
+    // Число потоков для пересчёта, включая вызывающий. 1 — без пула.
+    void SetThreadCount(size_t thread_count);
+    size_t GetThreadCount() const;
+
+    // Вычисляет устаревшие формулы из roots и все устаревшие формулы, от
+    // которых они зависят. Актуальные ячейки пропускаются. epoch — номер
+    // обхода от Sheet::BeginTraversal для отметок посещённых ячеек.
+    void Evaluate(const std::vector<const Cell*>& roots, uint32_t epoch);
+
+    // Выполняет body(begin, end) для отрезков [0, count) на потоках
+    // пересчёта, а без пула — одним вызовом в текущем потоке
+    void ParallelFor(size_t count, size_t grain,
+                     const std::function<void(size_t, size_t)>& body);
+
+private:
+    // Меньшие объёмы дешевле посчитать в одном потоке
+    static constexpr size_t MIN_PARALLEL_CELLS = 256;
+    static constexpr size_t MIN_PARALLEL_LEVEL = 64;
+
+    static bool IsDirty(const Cell* cell);
+    static void Compute(const Cell* cell);
+
+    std::vector<const Cell*> CollectInTopologicalOrder(
+        const std::vector<const Cell*>& roots, uint32_t epoch) const;
+    void EvaluateInParallel(const std::vector<const Cell*>& order);
+    void EvaluateByLevels(const std::vector<const Cell*>& order,
+                          const std::vector<size_t>& component,
+                          const std::vector<size_t>& levels);
+
+    std::unique_ptr<ThreadPool> pool_;
+};
@@ -1,9 +1,11 @@
 #include "sheet.h"
 
+#include "trace.h"
+
 #include <algorithm>
 #include <functional>
 #include <iostream>
-#include <limits>
+#include <mutex>
 
 using namespace std::literals;
 
@@ -12,19 +14,314 @@ Sheet::~Sheet() {}
 void Sheet::SetCell(Position pos, std::string text) {
   if (!pos.IsValid())
     throw InvalidPositionException("Sheet::SetCell: Invalid position");
+  Trace::Scope trace("Sheet::SetCell", pos);
 
-  if (!cells_.count(pos)) {
-    std::unique_ptr<Cell> cell = std::make_unique<Cell>(*this, pos);
-    cell -> Set(std::move(text));
-    cells_[pos] = std::move(cell);
+  Cell *cell = cells_.Find(pos);
+  if (!cell) {
+    // Новую ячейку внутри чужого диапазона проще всего поставить в начало
+    // порядка: входящих ссылок у неё ещё нет
+    const int64_t order = range_dependencies_.Covers(pos) ? --first_order_
+                                                          : ++last_order_;
+    cell = &cells_.Emplace(pos, *this, pos, order);
+    try {
+      cell->Set(std::move(text));
+    } catch (...) {
+      cells_.Erase(pos);
+      throw;
+    }
+    UpdatePrintableArea(pos, true, cell->IsEmpty());
   } else {
-    cells_[pos]->Set(std::move(text));
+    bool was_empty = cell->IsEmpty();
+    cell->Set(std::move(text));
+    UpdatePrintableArea(pos, was_empty, cell->IsEmpty());
   }
 }
 
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+  Trace::Scope trace("Sheet::SetCells");
+  for (const auto &[pos, text] : cells) {
+    if (!pos.IsValid()) {
+      throw InvalidPositionException("Sheet::SetCells: Invalid position");
+    }
+  }
+
+  if (cells.empty()) {
+    return;
+  }
+
+  // Из нескольких записей в одну ячейку действует последняя. Порядок по
+  // позициям заодно кладёт новые ячейки каждого блока в память подряд.
+  std::stable_sort(cells.begin(), cells.end(),
+                   [](const auto &lhs, const auto &rhs) {
+                     return lhs.first < rhs.first;
+                   });
+  size_t unique_count = 0;
+  for (size_t i = 0; i < cells.size(); ++i) {
+    if (i + 1 < cells.size() && cells[i + 1].first == cells[i].first) {
+      continue;
+    }
+    if (unique_count != i) {
+      cells[unique_count] = std::move(cells[i]);
+    }
+    ++unique_count;
+  }
+  cells.resize(unique_count);
+
+  // Разбор не трогает лист, поэтому идёт параллельно. Сообщается ошибка
+  // первой по позиции ячейки, как при последовательных SetCell.
+  constexpr size_t PARSE_GRAIN = 1024;
+  stats_.Add(SheetStatsCounters::PARSED_TEXTS, cells.size());
+  std::vector<Cell::Content> contents(cells.size());
+  std::mutex error_mutex;
+  size_t error_index = cells.size();
+  std::string error_message;
+  {
+    // Потоки разбора выделяют память листа одновременно
+    MemoryPool::SharedScope shared_memory(memory_);
+    recalc_engine_.ParallelFor(
+        cells.size(), PARSE_GRAIN, [&](size_t begin, size_t end) {
+          // Время разбора суммируется по всем потокам
+          Trace::Scope trace("Parse", cells[begin].first);
+          SheetStatsCounters::Timer timer(stats_, SheetStatsCounters::PARSE_NS);
+          for (size_t i = begin; i < end; ++i) {
+            try {
+              contents[i] =
+                  Cell::Content(std::move(cells[i].second), &memory_);
+            } catch (const FormulaException &e) {
+              std::lock_guard lock(error_mutex);
+              if (i < error_index) {
+                error_index = i;
+                error_message = e.what();
+              }
+              return;
+            }
+          }
+        });
+  }
+  if (error_index < cells.size()) {
+    throw FormulaException(cells[error_index].first.ToString() + ": " +
+                           error_message);
+  }
+
+  // Содержимое подменяется у всех ячеек сразу, затем заменяются рёбра;
+  // после обмена в contents остаётся прежнее содержимое для отката
+  const int64_t first_order = first_order_;
+  const int64_t last_order = last_order_;
+  std::vector<Cell *> targets;
+  std::vector<Position> created;
+  targets.reserve(cells.size());
+  for (size_t i = 0; i < cells.size(); ++i) {
+    const Position pos = cells[i].first;
+    Cell *cell = cells_.Find(pos);
+    if (!cell) {
+      cell = &cells_.Emplace(pos, *this, pos, ++last_order_);
+      created.push_back(pos);
+    }
+    std::swap(cell->content_, contents[i]);
+    targets.push_back(cell);
+  }
+  auto rebuild_references = [&targets] {
+    for (Cell *cell : targets) {
+      cell->NewReference(cell->content_.GetReferencedCells(),
+                         cell->content_.GetReferencedRanges());
+    }
+  };
+  rebuild_references();
+
+  std::vector<Position> cyclic;
+  {
+    SheetStatsCounters::Timer timer(stats_, SheetStatsCounters::CYCLE_CHECK_NS);
+    cyclic = RebuildTopologicalOrder();
+  }
+  stats_.Add(SheetStatsCounters::CYCLE_CHECKS);
+  if (!cyclic.empty()) {
+    stats_.Add(SheetStatsCounters::REJECTED_CYCLES);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      std::swap(targets[i]->content_, contents[i]);
+    }
+    rebuild_references();
+    // Кроме ячеек пакета убираются пустые ячейки, созданные ради его ссылок:
+    // GetOrCreateCell ставит их перед first_order, а после отката на них
+    // больше никто не ссылается. Порядок при цикле восстановлен прежним.
+    cells_.ForEach([&](Position pos, Cell &cell) {
+      if (cell.order_ < first_order) {
+        created.push_back(pos);
+      }
+    });
+    for (Position pos : created) {
+      cells_.Erase(pos);
+    }
+    first_order_ = first_order;
+    last_order_ = last_order;
+
+    constexpr size_t MAX_LISTED = 10;
+    std::string message = "Cyclic dependency detected:";
+    for (size_t i = 0; i < std::min(cyclic.size(), MAX_LISTED); ++i) {
+      message += (i == 0 ? " " : ", ") + cyclic[i].ToString();
+    }
+    if (cyclic.size() > MAX_LISTED) {
+      message += ", ...";
+    }
+    throw CyclicCellsException(message, std::move(cyclic));
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    UpdatePrintableArea(cells[i].first, contents[i].IsEmpty(),
+                        targets[i]->IsEmpty());
+  }
+  for (Cell *cell : targets) {
+    cell->InvalidCache();
+  }
+}
+
+std::vector<Position> Sheet::RebuildTopologicalOrder() {
+  Trace::Scope trace("Sheet::RebuildTopologicalOrder");
+  // Обход в глубину с явным стеком. На время обхода order_ хранит номер
+  // ячейки в порядке посещения; компоненты сильной связности выходят после
+  // всех компонент, на которые они ссылаются, то есть уже в топологическом
+  // порядке. Соседи ячейки собираются в общий вектор при её посещении,
+  // потому что ForEachReferenced нельзя прервать и продолжить.
+  std::vector<Cell *> all;
+  all.reserve(cells_.Size());
+  std::vector<int64_t> old_orders;
+  old_orders.reserve(cells_.Size());
+  cells_.ForEach([&](Position, Cell &cell) {
+    all.push_back(&cell);
+    old_orders.push_back(cell.order_);
+  });
+
+  struct Frame {
+    Cell *cell;
+    size_t begin;
+    size_t next;
+    size_t end;
+  };
+
+  const uint32_t epoch = BeginTraversal();
+  std::vector<int64_t> lowlinks;
+  std::vector<char> on_stack;
+  std::vector<char> self_referencing;
+  std::vector<Cell *> component_stack;
+  std::vector<Cell *> neighbours;
+  std::vector<Frame> frames;
+  std::vector<Cell *> sorted;
+  std::vector<Position> cyclic;
+  sorted.reserve(all.size());
+
+  auto open = [&](Cell *cell) {
+    cell->Visit(epoch);
+    cell->order_ = static_cast<int64_t>(lowlinks.size());
+    lowlinks.push_back(cell->order_);
+    on_stack.push_back(true);
+    self_referencing.push_back(false);
+    component_stack.push_back(cell);
+    const size_t begin = neighbours.size();
+    cell->ForEachReferenced([&](Cell *reference) {
+      if (reference == cell) {
+        self_referencing.back() = true;
+      }
+      neighbours.push_back(reference);
+    });
+    frames.push_back({cell, begin, begin, neighbours.size()});
+  };
+
+  for (Cell *root : all) {
+    if (root->visit_epoch_ == epoch) {
+      continue;
+    }
+    open(root);
+    while (!frames.empty()) {
+      Frame &frame = frames.back();
+      const int64_t index = frame.cell->order_;
+      if (frame.next < frame.end) {
+        Cell *reference = neighbours[frame.next++];
+        if (reference->visit_epoch_ != epoch) {
+          open(reference);
+        } else if (on_stack[reference->order_]) {
+          lowlinks[index] = std::min(lowlinks[index], reference->order_);
+        }
+        continue;
+      }
+
+      neighbours.resize(frame.begin);
+      frames.pop_back();
+      if (!frames.empty()) {
+        int64_t &parent_lowlink = lowlinks[frames.back().cell->order_];
+        parent_lowlink = std::min(parent_lowlink, lowlinks[index]);
+      }
+      if (lowlinks[index] != index) {
+        continue;
+      }
+
+      // Компонента из нескольких ячеек или ячейка со ссылкой на себя —
+      // цикл
+      const size_t component_begin = sorted.size();
+      Cell *member = nullptr;
+      do {
+        member = component_stack.back();
+        component_stack.pop_back();
+        on_stack[member->order_] = false;
+        sorted.push_back(member);
+      } while (member->order_ != index);
+      if (sorted.size() - component_begin > 1 || self_referencing[index]) {
+        for (size_t i = component_begin; i < sorted.size(); ++i) {
+          cyclic.push_back(sorted[i]->position_);
+        }
+      }
+    }
+  }
+
+  if (!cyclic.empty()) {
+    for (size_t i = 0; i < all.size(); ++i) {
+      all[i]->order_ = old_orders[i];
+    }
+    std::sort(cyclic.begin(), cyclic.end());
+    return cyclic;
+  }
+
+  // Пустые ячейки, созданные ради ссылок, по-прежнему ставятся перед всеми
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    sorted[i]->order_ = static_cast<int64_t>(i) + 1;
+  }
+  first_order_ = 0;
+  last_order_ = static_cast<int64_t>(sorted.size());
+  return cyclic;
+}
+
 bool Sheet::IsCellAvailable(Position pos) const {
-  Size size_area = GetPrintableSize();
-  return pos.row < size_area.rows && pos.col < size_area.cols;
+  return pos.row < printable_size_.rows && pos.col < printable_size_.cols;
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool was_empty, bool is_empty) {
+  if (was_empty == is_empty) {
+    return;
+  }
+
+  if (!is_empty) {
+    if (static_cast<int>(row_counts_.size()) <= pos.row) {
+      row_counts_.resize(pos.row + 1);
+    }
+    if (static_cast<int>(col_counts_.size()) <= pos.col) {
+      col_counts_.resize(pos.col + 1);
+    }
+    ++row_counts_[pos.row];
+    ++col_counts_[pos.col];
+    printable_size_.rows = std::max(printable_size_.rows, pos.row + 1);
+    printable_size_.cols = std::max(printable_size_.cols, pos.col + 1);
+    return;
+  }
+
+  --row_counts_[pos.row];
+  --col_counts_[pos.col];
+  // Граница сдвигается только если опустела крайняя строка или столбец
+  while (printable_size_.rows > 0 &&
+         row_counts_[printable_size_.rows - 1] == 0) {
+    --printable_size_.rows;
+  }
+  while (printable_size_.cols > 0 &&
+         col_counts_[printable_size_.cols - 1] == 0) {
+    --printable_size_.cols;
+  }
 }
 
 const CellInterface *Sheet::GetCell(Position pos) const {
@@ -35,6 +332,33 @@ CellInterface *Sheet::GetCell(Position pos) {
   return GetConcreteCell(pos);
 }
 
+std::optional<FormulaError>
+Sheet::GetRangeNumbers(CellRange range, std::vector<double> &numbers) const {
+  if (!range.IsValid()) {
+    return FormulaError(FormulaError::Category::Ref);
+  }
+
+  // Пустые блоки листа пропускаются без поиска отдельных ячеек. Блоки
+  // обходятся не в порядке строк диапазона, поэтому из нескольких ошибок
+  // выбирается ошибка ячейки с наименьшей позицией, а не первая встреченная.
+  std::optional<FormulaError> error;
+  Position error_pos = Position::NONE;
+  cells_.ForEachInRange(
+      range.first, range.last, [&](Position pos, const Cell &cell) {
+        auto value = cell.GetAggregateValue();
+        if (!value) {
+          return;
+        }
+        if (auto *number = std::get_if<double>(&*value)) {
+          numbers.push_back(*number);
+        } else if (!error || pos < error_pos) {
+          error = std::get<FormulaError>(*value);
+          error_pos = pos;
+        }
+      });
+  return error;
+}
+
 const Cell* Sheet::GetConcreteCell(Position pos) const {
   return const_cast<Sheet*>(this)->GetConcreteCell(pos);
 } 
@@ -43,72 +367,45 @@ Cell* Sheet::GetConcreteCell(Position pos){
   if (!pos.IsValid())
     throw InvalidPositionException("Sheet::GetConcreteCell: Invalid position");
 
-  if (IsCellAvailable(pos) && cells_.count(pos)) {
-    return cells_.at(pos).get();
+  if (IsCellAvailable(pos)) {
+    return cells_.Find(pos);
   } else {
     return nullptr;
   }
 } 
 
-void Sheet::ClearCell(Position pos) {
-  if (!pos.IsValid()) {
-    throw InvalidPositionException("Sheet::ClearCell: Invalid position");
+Cell *Sheet::GetOrCreateCell(Position pos) {
+  Cell *cell = cells_.Find(pos);
+  if (!cell) {
+    cell = &cells_.Emplace(pos, *this, pos, --first_order_);
   }
-  if (IsCellAvailable(pos)) {
-    cells_.at(pos)->Clear();
-  } 
+  return cell;
 }
 
-Size Sheet::GetPrintableSize() const {
-  if (cells_.empty()) {
-    return Size{}; // Если таблица пуста, возвращаем размер (0, 0)
-  }
-
-  // Инициализируем минимальные и максимальные значения
-  int min_row = std::numeric_limits<int>::max();
-  int max_row = std::numeric_limits<int>::min();
-  int min_col = std::numeric_limits<int>::max();
-  int max_col = std::numeric_limits<int>::min();
-
-  bool has_non_empty_cells = false;
-
-  for (const auto &[position, cell_ptr] : cells_) {
-    if (cell_ptr &&
-        !cell_ptr->GetText()
-             .empty()) { // Учитываем только ячейки с непустым текстом
-      has_non_empty_cells = true;
-      min_row = std::min(min_row, position.row);
-      max_row = std::max(max_row, position.row);
-      min_col = std::min(min_col, position.col);
-      max_col = std::max(max_col, position.col);
-    }
+void Sheet::ClearCell(Position pos) {
+  if (!pos.IsValid()) {
+    throw InvalidPositionException("Sheet::ClearCell: Invalid position");
   }
-
-  if (!has_non_empty_cells) {
-    return Size{}; // Если нет ячеек с непустым текстом, возвращаем (0, 0)
+  Cell *cell = GetConcreteCell(pos);
+  if (cell) {
+    bool was_empty = cell->IsEmpty();
+    cell->Clear();
+    UpdatePrintableArea(pos, was_empty, true);
   }
-
-  // Возвращаем размер минимальной печатной области
-  return {max_row + 1,
-          max_col + 1}; // Индексы начинаются с 0, поэтому добавляем 1
 }
 
+Size Sheet::GetPrintableSize() const { return printable_size_; }
+
 void Sheet::PrintValues(std::ostream &output) const {
-  for (int y = 0; y < GetPrintableSize().rows; ++y) {
-    for (int x = 0; x < GetPrintableSize().cols; ++x) {
+  const Size size = GetPrintableSize();
+  for (int y = 0; y < size.rows; ++y) {
+    for (int x = 0; x < size.cols; ++x) {
       if (x > 0) {
         output << '\t';
       }
-      Position pos{y, x};
-      if (cells_.count(pos) > 0) {
-        if (std::holds_alternative<double>(cells_.at(pos)->GetValue())) {
-          output << std::get<double>(cells_.at(pos)->GetValue());
-        } else if (std::holds_alternative<std::string>(
-                       cells_.at(pos)->GetValue())) {
-          output << std::get<std::string>(cells_.at(pos)->GetValue());
-        } else {
-          output << std::get<FormulaError>(cells_.at(pos)->GetValue());
-        }
+      if (const Cell *cell = cells_.Find({y, x})) {
+        std::visit([&output](const auto &value) { output << value; },
+                   cell->GetValue());
       }
     }
 
@@ -116,14 +413,14 @@ void Sheet::PrintValues(std::ostream &output) const {
   }
 }
 void Sheet::PrintTexts(std::ostream &output) const {
-  for (int y = 0; y < GetPrintableSize().rows; ++y) {
-    for (int x = 0; x < GetPrintableSize().cols; ++x) {
+  const Size size = GetPrintableSize();
+  for (int y = 0; y < size.rows; ++y) {
+    for (int x = 0; x < size.cols; ++x) {
       if (x > 0) {
         output << '\t';
       }
-      Position pos{y, x};
-      if (cells_.count(pos) > 0) {
-        output << cells_.at(pos)->GetText();
+      if (const Cell *cell = cells_.Find({y, x})) {
+        output << cell->GetText();
       }
     }
 
@@ -131,6 +428,131 @@ void Sheet::PrintTexts(std::ostream &output) const {
   }
 }
 
+void Sheet::Evaluate(const Cell &cell) {
+  Trace::Scope trace("Sheet::Evaluate", cell.position_);
+  std::lock_guard lock(evaluate_mutex_);
+  // Другой читатель мог вычислить ячейку, пока этот ждал; тогда обход
+  // сразу закончится на ней
+  recalc_engine_.Evaluate({&cell}, BeginTraversal());
+}
+
+void Sheet::Recalculate() {
+  Trace::Scope trace("Sheet::Recalculate");
+  std::vector<const Cell *> formulas;
+  cells_.ForEach([&formulas](Position, const Cell &cell) {
+    formulas.push_back(&cell);
+  });
+  std::lock_guard lock(evaluate_mutex_);
+  recalc_engine_.Evaluate(formulas, BeginTraversal());
+}
+
+void Sheet::SetRecalcThreadCount(size_t thread_count) {
+  recalc_engine_.SetThreadCount(thread_count);
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::TakeSnapshot() {
+  Trace::Scope trace("Sheet::TakeSnapshot");
+  using Tile = SheetSnapshot::Tile;
+  using TileRow = SheetSnapshot::TileRow;
+
+  // Первый снимок строится из всех блоков, следующие — из изменившихся
+  std::vector<Position> tiles;
+  if (last_snapshot_) {
+    tiles.assign(changed_tiles_.begin(), changed_tiles_.end());
+  } else {
+    PositionsSet all_tiles;
+    cells_.ForEach([&all_tiles](Position pos, const Cell &) {
+      all_tiles.insert(SnapshotTile(pos));
+    });
+    tiles.assign(all_tiles.begin(), all_tiles.end());
+  }
+  std::sort(tiles.begin(), tiles.end());
+  changed_tiles_.clear();
+
+  auto tile_range = [](Position tile) {
+    const Position first{tile.row * SheetSnapshot::TILE_ROWS,
+                         tile.col * SheetSnapshot::TILE_COLS};
+    return CellRange{first, {first.row + SheetSnapshot::TILE_ROWS - 1,
+                             first.col + SheetSnapshot::TILE_COLS - 1}};
+  };
+
+  // Устаревшие формулы могут быть только в изменившихся блоках
+  std::vector<const Cell *> roots;
+  for (Position tile : tiles) {
+    ForEachCellInRange(tile_range(tile),
+                       [&roots](const Cell *cell) { roots.push_back(cell); });
+  }
+  {
+    std::lock_guard lock(evaluate_mutex_);
+    recalc_engine_.Evaluate(roots, BeginTraversal());
+  }
+
+  auto snapshot = std::make_shared<SheetSnapshot>();
+  if (last_snapshot_) {
+    snapshot->rows_ = last_snapshot_->rows_;
+    snapshot->version_ = last_snapshot_->version_ + 1;
+  }
+  snapshot->printable_size_ = printable_size_;
+
+  // Строка каталога копируется один раз, при первом изменённом блоке в ней
+  size_t copied_row = SIZE_MAX;
+  TileRow *row = nullptr;
+  for (Position tile_pos : tiles) {
+    const size_t tile_row = tile_pos.row;
+    const size_t tile_col = tile_pos.col;
+    if (tile_row != copied_row) {
+      if (snapshot->rows_.size() <= tile_row) {
+        snapshot->rows_.resize(tile_row + 1);
+      }
+      auto &shared_row = snapshot->rows_[tile_row];
+      auto copy = shared_row ? std::make_shared<TileRow>(*shared_row)
+                             : std::make_shared<TileRow>();
+      row = copy.get();
+      shared_row = std::move(copy);
+      copied_row = tile_row;
+    }
+    if (row->size() <= tile_col) {
+      row->resize(tile_col + 1);
+    }
+
+    auto tile = std::make_shared<Tile>();
+    tile->slots.fill(SheetSnapshot::NO_CELL);
+    const CellRange range = tile_range(tile_pos);
+    cells_.ForEachInRange(
+        range.first, range.last, [&](Position pos, const Cell &cell) {
+          if (cell.IsEmpty()) {
+            return;
+          }
+          const int index =
+              (pos.row - range.first.row) * SheetSnapshot::TILE_COLS +
+              (pos.col - range.first.col);
+          tile->slots[index] = static_cast<uint16_t>(tile->cells.size());
+          tile->cells.push_back({cell.GetText(), cell.GetValue()});
+        });
+    (*row)[tile_col] = tile->cells.empty() ? nullptr : std::move(tile);
+  }
+
+  last_snapshot_ = snapshot;
+  return snapshot;
+}
+
+uint32_t Sheet::BeginTraversal() {
+  if (++traversal_epoch_ == 0) {
+    // Счётчик переполнился: старые отметки могли бы совпасть с новыми
+    cells_.ForEach([](Position, const Cell &cell) { cell.ResetVisit(); });
+    traversal_epoch_ = 1;
+  }
+  return traversal_epoch_;
+}
+
+void Sheet::AddRangeDependency(CellRange range, Cell *formula) {
+  range_dependencies_.Insert(range, formula);
+}
+
+void Sheet::RemoveRangeDependency(CellRange range, Cell *formula) {
+  range_dependencies_.Erase(range, formula);
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
   return std::make_unique<Sheet>();
 }
\ No newline at end of file
@@ -2,8 +2,21 @@
 
 #include "common.h"
 #include "cell.h"
+#include "memory_pool.h"
+#include "positions_set.h"
+#include "range_index.h"
+#include "recalc_engine.h"
+#include "sheet_snapshot.h"
+#include "sheet_stats.h"
+#include "tiled_grid.h"
 
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 class Sheet : public SheetInterface {  
@@ -13,12 +26,28 @@ public:
 
     void SetCell(Position pos, std::string text) override;
 
+    // Пакетная запись ячеек: результат тот же, что у SetCell для каждой пары
+    // по порядку, но тексты разбираются заранее (на потоках пересчёта, если
+    // они заданы), граф зависимостей перестраивается за один проход, а циклы
+    // ищутся один раз по всему листу. Стоимость — O(размер листа), поэтому
+    // метод рассчитан на загрузку больших объёмов, а не на отдельные правки.
+    // При ошибке лист не меняется: некорректная позиция —
+    // InvalidPositionException, некорректная формула — FormulaException с
+    // позицией ячейки, циклы — CyclicCellsException со всеми ячейками циклов.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
     const CellInterface *GetCell(Position pos) const override;
     CellInterface *GetCell(Position pos) override;
+
+    std::optional<FormulaError> GetRangeNumbers(
+        CellRange range, std::vector<double>& numbers) const override;
     
     const Cell* GetConcreteCell(Position pos) const; 
     Cell* GetConcreteCell(Position pos);  
 
+    // Возвращает ячейку по позиции, при необходимости создавая пустую
+    Cell* GetOrCreateCell(Position pos);
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
@@ -27,9 +56,149 @@ public:
 
     void PrintTexts(std::ostream &output) const override;
 
+    // Вычисляет формулу ячейки вместе с устаревшими формулами, от которых
+    // она зависит.
+    //
+    // Чтение значений (GetCell(...)->GetValue()) можно вести из нескольких
+    // потоков одновременно, если лист в это время не правится: актуальные
+    // значения читаются из атомарного кэша ячеек без блокировок, а
+    // вычисление устаревших идёт здесь под мьютексом листа — обход графа
+    // пользуется общими отметками. Для чтения во время правок есть
+    // TakeSnapshot.
+    void Evaluate(const Cell& cell);
+
+    // Пересчитывает все устаревшие формулы таблицы, например перед выгрузкой
+    void Recalculate();
+
+    // Число потоков, которыми пересчитываются формулы (по умолчанию 1)
+    void SetRecalcThreadCount(size_t thread_count);
+
+    // Вычисляет устаревшие формулы и возвращает неизменяемый снимок листа
+    // для чтения из других потоков. Снимок разделяет с предыдущим все
+    // блоки, в которых с тех пор не менялись ни тексты, ни значения, поэтому
+    // стоит пропорционально числу изменённых блоков. Вызывается из потока,
+    // который правит лист.
+    std::shared_ptr<const SheetSnapshot> TakeSnapshot();
+
+    // Отмечает, что текст или значение ячейки могли измениться. Пока
+    // снимков не было, ничего не делает.
+    void NoteChange(Position pos) {
+        if (last_snapshot_) {
+            changed_tiles_.insert(SnapshotTile(pos));
+        }
+    }
+
+    // Память содержимого ячеек, формул и рёбер графа зависимостей.
+    // Выделения в ней дешевле общей кучи, соседние объекты ложатся рядом, а
+    // при уничтожении листа память возвращается крупными блоками.
+    std::pmr::memory_resource* GetMemoryResource() {
+        return &memory_;
+    }
+
+    // Снимок счётчиков работы листа (см. SheetStats) и их обнуление между
+    // окнами измерений. Без SPREADSHEET_STATS снимок нулевой.
+    SheetStats GetStats() const {
+        return stats_.Snapshot();
+    }
+    void ResetStats() {
+        stats_.Reset();
+    }
+
+    // Счётчики, которые ведут ячейки и пересчёт
+    SheetStatsCounters& GetStatsCounters() {
+        return stats_;
+    }
+
+    // Номер нового обхода графа зависимостей для отметок в ячейках
+    uint32_t BeginTraversal();
+
+    // Зависимости формул от диапазонов целиком
+    void AddRangeDependency(CellRange range, Cell* formula);
+    void RemoveRangeDependency(CellRange range, Cell* formula);
+
+    // Формулы, диапазоны которых покрывают pos, за
+    // O(log MAX_ROWS * log MAX_COLS) плюс число найденных
+    template <typename Visitor>
+    void ForEachRangeDependent(Position pos, Visitor&& visitor) const {
+        range_dependencies_.ForEachCovering(pos, visitor);
+    }
+
+    // Существующие ячейки диапазона, включая пустые
+    template <typename Visitor>
+    void ForEachCellInRange(CellRange range, Visitor&& visitor) {
+        cells_.ForEachInRange(range.first, range.last, [&visitor](Position, Cell& cell) {
+            visitor(&cell);
+        });
+    }
+
 private:
+    friend class BinarySnapshot;
+
     // Можете дополнить ваш класс нужными полями и методами
-    std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher> cells_;
+
+    // Объявлена раньше ячеек, чтобы пережить их
+    MemoryPool memory_;
+    TiledGrid<Cell> cells_;
+    RecalcEngine recalc_engine_;
+
+    // Количество непустых ячеек в каждой строке и в каждом столбце.
+    // Поддерживаются при SetCell/ClearCell, поэтому печатная область
+    // известна без обхода всех ячеек.
+    std::vector<int> row_counts_;
+    std::vector<int> col_counts_;
+    Size printable_size_;
+
+    // Границы топологического порядка ячеек. Пустая ячейка, созданная ради
+    // ссылки на неё, ставится перед всеми, а заполняемая через SetCell —
+    // после всех: тогда типичная правка не требует перестановок.
+    int64_t first_order_ = 0;
+    int64_t last_order_ = 0;
+
+    uint32_t traversal_epoch_ = 0;
+    // Вычисления устаревших формул из разных потоков-читателей
+    std::mutex evaluate_mutex_;
+
+    RangeIndex<Cell*> range_dependencies_;
+
+    SheetStatsCounters stats_;
+
+    // Последний снимок и блоки, изменившиеся после него
+    std::shared_ptr<const SheetSnapshot> last_snapshot_;
+    PositionsSet changed_tiles_;
+
+    // Блок снимка, в который попадает позиция: строка и столбец блока
+    static Position SnapshotTile(Position pos) {
+        return {pos.row / SheetSnapshot::TILE_ROWS, pos.col / SheetSnapshot::TILE_COLS};
+    }
+
+    // Заново нумерует все ячейки в топологическом порядке (алгоритм Тарьяна
+    // по ссылкам формул). Если в графе есть циклы, прежние номера
+    // сохраняются, а возвращаются позиции всех ячеек циклов.
+    std::vector<Position> RebuildTopologicalOrder();
 
     bool IsCellAvailable(Position pos) const;
-};
\ No newline at end of file
+    void UpdatePrintableArea(Position pos, bool was_empty, bool is_empty);
+};
+
+template <typename Visitor>
+void Cell::ForEachDependent(Visitor&& visitor) const {
+    if (links_) {
+        for (Cell* cell : links_->dependent_cells) {
+            visitor(cell);
+        }
+    }
+    sheet_.ForEachRangeDependent(position_, visitor);
+}
+
+template <typename Visitor>
+void Cell::ForEachReferenced(Visitor&& visitor) const {
+    if (!links_) {
+        return;
+    }
+    for (const Reference& reference : links_->referenced_cells) {
+        visitor(reference.cell);
+    }
+    for (const CellRange& range : links_->referenced_ranges) {
+        sheet_.ForEachCellInRange(range, visitor);
+    }
+}
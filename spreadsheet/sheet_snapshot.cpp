@@ -0,0 +1,52 @@
+#include "sheet_snapshot.h"
+
+#include <ostream>
+#include <variant>
+
+const SheetSnapshot::CellData *SheetSnapshot::GetCell(Position pos) const {
+  if (!pos.IsValid()) {
+    throw InvalidPositionException("SheetSnapshot::GetCell: Invalid position");
+  }
+  const size_t tile_row = pos.row / TILE_ROWS;
+  const size_t tile_col = pos.col / TILE_COLS;
+  if (tile_row >= rows_.size() || !rows_[tile_row] ||
+      tile_col >= rows_[tile_row]->size()) {
+    return nullptr;
+  }
+  const Tile *tile = (*rows_[tile_row])[tile_col].get();
+  if (!tile) {
+    return nullptr;
+  }
+  const uint16_t slot =
+      tile->slots[(pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS];
+  return slot == NO_CELL ? nullptr : &tile->cells[slot];
+}
+
+void SheetSnapshot::PrintValues(std::ostream &output) const {
+  for (int y = 0; y < printable_size_.rows; ++y) {
+    for (int x = 0; x < printable_size_.cols; ++x) {
+      if (x > 0) {
+        output << '\t';
+      }
+      if (const CellData *cell = GetCell({y, x})) {
+        std::visit([&output](const auto &value) { output << value; },
+                   cell->value);
+      }
+    }
+    output << '\n';
+  }
+}
+
+void SheetSnapshot::PrintTexts(std::ostream &output) const {
+  for (int y = 0; y < printable_size_.rows; ++y) {
+    for (int x = 0; x < printable_size_.cols; ++x) {
+      if (x > 0) {
+        output << '\t';
+      }
+      if (const CellData *cell = GetCell({y, x})) {
+        output << cell->text;
+      }
+    }
+    output << '\n';
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Неизменяемый снимок текстов и значений ячеек листа (Sheet::TakeSnapshot).
+// После создания снимок не меняется, поэтому его можно читать из любого
+// числа потоков без блокировок, пока лист продолжает правиться.
+//
+// Снимки разделяют данные: ячейки хранятся блоками по 16x16, как в
+// TiledGrid, и следующий снимок заново строит только блоки, в которых
+// что-то изменилось, а остальные блоки и строки каталога берёт у
+// предыдущего.
+class SheetSnapshot {
+public:
+    struct CellData {
+        std::string text;
+        CellInterface::Value value;
+    };
+
+    // Ячейка снимка или nullptr, если она пуста. Некорректная позиция —
+    // InvalidPositionException.
+    const CellData* GetCell(Position pos) const;
+
+    Size GetPrintableSize() const {
+        return printable_size_;
+    }
+
+    // Вывод в формате Sheet::PrintValues и Sheet::PrintTexts
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+    // Номер снимка у его листа, растёт с каждым снимком
+    uint64_t GetVersion() const {
+        return version_;
+    }
+
+private:
+    friend class Sheet;
+
+    static constexpr int TILE_ROWS = 16;
+    static constexpr int TILE_COLS = 16;
+    static constexpr int TILE_AREA = TILE_ROWS * TILE_COLS;
+    static constexpr uint16_t NO_CELL = 0xFFFF;
+
+    struct Tile {
+        std::array<uint16_t, TILE_AREA> slots;  // номер в cells или NO_CELL
+        std::vector<CellData> cells;
+    };
+    using TileRow = std::vector<std::shared_ptr<const Tile>>;
+
+    std::vector<std::shared_ptr<const TileRow>> rows_;
+    Size printable_size_;
+    uint64_t version_ = 0;
+};
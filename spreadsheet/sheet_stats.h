@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Счётчики работы листа: сколько формул вычислено, как часто значение
+// формулы бралось из кэша, сколько кэшей сбросили правки и сколько времени
+// ушло на разбор формул и проверки циклов. Считаются, только если проект
+// собран с SPREADSHEET_STATS; иначе счётчики ничего не делают, а снимок
+// всегда нулевой.
+struct SheetStats {
+    static constexpr bool ENABLED =
+#ifdef SPREADSHEET_STATS
+        true;
+#else
+        false;
+#endif
+
+    uint64_t formula_evaluations = 0;  // вычисления формул
+    uint64_t cache_hits = 0;           // чтения значения формулы из актуального кэша
+    uint64_t cache_misses = 0;         // чтения, после которых формулу пришлось вычислять
+    uint64_t invalidated_caches = 0;   // кэши формул, сброшенные правками
+    uint64_t parsed_texts = 0;         // разобранные тексты ячеек (SetCell, SetCells)
+    uint64_t parse_ns = 0;
+    uint64_t cycle_checks = 0;         // проверки циклов: по одной на SetCell и SetCells
+    uint64_t cycle_check_ns = 0;
+    uint64_t rejected_cycles = 0;      // правки, отвергнутые из-за цикла
+};
+
+// Счётчики одного листа. Увеличиваются из любых потоков (вычисления на
+// потоках пересчёта, одновременное чтение значений), поэтому атомарны;
+// порядок между счётчиками не гарантируется, снимок согласован только
+// в отсутствие работы с листом.
+class SheetStatsCounters {
+public:
+    enum Counter : size_t {
+        FORMULA_EVALUATIONS,
+        CACHE_HITS,
+        CACHE_MISSES,
+        INVALIDATED_CACHES,
+        PARSED_TEXTS,
+        PARSE_NS,
+        CYCLE_CHECKS,
+        CYCLE_CHECK_NS,
+        REJECTED_CYCLES,
+        COUNTER_COUNT
+    };
+
+    // Засекает время от создания до уничтожения и прибавляет его к
+    // счётчику; без SPREADSHEET_STATS часы не читаются
+    class Timer {
+    public:
+        Timer(SheetStatsCounters& counters, Counter counter)
+            : counters_(counters), counter_(counter) {
+#ifdef SPREADSHEET_STATS
+            start_ = std::chrono::steady_clock::now();
+#endif
+        }
+        ~Timer() {
+#ifdef SPREADSHEET_STATS
+            const auto elapsed = std::chrono::steady_clock::now() - start_;
+            counters_.Add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+#endif
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+    private:
+        [[maybe_unused]] SheetStatsCounters& counters_;
+        [[maybe_unused]] Counter counter_;
+#ifdef SPREADSHEET_STATS
+        std::chrono::steady_clock::time_point start_;
+#endif
+    };
+
+    void Add([[maybe_unused]] Counter counter, [[maybe_unused]] uint64_t value = 1) {
+#ifdef SPREADSHEET_STATS
+        counters_[counter].fetch_add(value, std::memory_order_relaxed);
+#endif
+    }
+
+    SheetStats Snapshot() const {
+        SheetStats stats;
+#ifdef SPREADSHEET_STATS
+        auto get = [this](Counter counter) {
+            return counters_[counter].load(std::memory_order_relaxed);
+        };
+        stats.formula_evaluations = get(FORMULA_EVALUATIONS);
+        stats.cache_hits = get(CACHE_HITS);
+        stats.cache_misses = get(CACHE_MISSES);
+        stats.invalidated_caches = get(INVALIDATED_CACHES);
+        stats.parsed_texts = get(PARSED_TEXTS);
+        stats.parse_ns = get(PARSE_NS);
+        stats.cycle_checks = get(CYCLE_CHECKS);
+        stats.cycle_check_ns = get(CYCLE_CHECK_NS);
+        stats.rejected_cycles = get(REJECTED_CYCLES);
+#endif
+        return stats;
+    }
+
+    void Reset() {
+#ifdef SPREADSHEET_STATS
+        for (auto& counter : counters_) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+private:
+#ifdef SPREADSHEET_STATS
+    std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters_{};
+#endif
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <type_traits>
+
+// Вектор для тривиально копируемых элементов, первые N из которых лежат в
+// самом объекте. Больший буфер берётся у memory_resource и растёт вдвое.
+// Рассчитан на короткие списки вроде рёбер графа зависимостей: пока
+// элементов мало, обход не уходит по указателю дальше самого объекта.
+template <typename T, size_t N>
+class SmallVector {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    explicit SmallVector(std::pmr::memory_resource* resource) : resource_(resource) {
+    }
+
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+
+    ~SmallVector() {
+        if (data_ != InlineData()) {
+            resource_->deallocate(data_, capacity_ * sizeof(T), alignof(T));
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t index) {
+        assert(index < size_);
+        return data_[index];
+    }
+
+    const T& operator[](size_t index) const {
+        assert(index < size_);
+        return data_[index];
+    }
+
+    T& Back() {
+        return (*this)[size_ - 1];
+    }
+
+    T* begin() {
+        return data_;
+    }
+
+    T* end() {
+        return data_ + size_;
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    void PushBack(const T& value) {
+        if (size_ == capacity_) {
+            Grow();
+        }
+        data_[size_++] = value;
+    }
+
+    void PopBack() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    // Удаляет элемент, ставя на его место последний; порядок не сохраняется
+    void SwapRemove(size_t index) {
+        data_[index] = Back();
+        PopBack();
+    }
+
+    // Буфер остаётся за вектором
+    void Clear() {
+        size_ = 0;
+    }
+
+private:
+    T* InlineData() {
+        return reinterpret_cast<T*>(inline_);
+    }
+
+    void Grow() {
+        const uint32_t capacity = capacity_ * 2;
+        T* data = static_cast<T*>(resource_->allocate(capacity * sizeof(T), alignof(T)));
+        std::memcpy(data, data_, size_ * sizeof(T));
+        if (data_ != InlineData()) {
+            resource_->deallocate(data_, capacity_ * sizeof(T), alignof(T));
+        }
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    std::pmr::memory_resource* resource_;
+    T* data_ = InlineData();
+    uint32_t size_ = 0;
+    uint32_t capacity_ = N;
+    alignas(T) unsigned char inline_[N * sizeof(T)];
+};
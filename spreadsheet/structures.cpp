@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <sstream>
 
 const int LETTERS = 26;
@@ -59,8 +60,9 @@ Position Position::FromString(std::string_view str) {
   }
 
   int row;
-  std::istringstream row_in{std::string{digits}};
-  if (!(row_in >> row) || !row_in.eof()) {
+  auto [end, error] =
+      std::from_chars(digits.data(), digits.data() + digits.size(), row);
+  if (error != std::errc() || end != digits.data() + digits.size()) {
     return Position::NONE;
   }
 
@@ -73,6 +75,32 @@ Position Position::FromString(std::string_view str) {
   return {row - 1, col - 1};
 }
 
+bool CellRange::operator==(CellRange rhs) const {
+  return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::IsValid() const {
+  return first.IsValid() && last.IsValid() && first.row <= last.row &&
+         first.col <= last.col;
+}
+
+bool CellRange::Contains(Position pos) const {
+  return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col &&
+         pos.col <= last.col;
+}
+
+std::string CellRange::ToString() const {
+  if (!IsValid()) {
+    return "";
+  }
+  return first.ToString() + ':' + last.ToString();
+}
+
+CellRange CellRange::FromCorners(Position lhs, Position rhs) {
+  return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+          {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 bool Size::operator==(Size rhs) const {
   return cols == rhs.cols && rows == rhs.rows;
 }
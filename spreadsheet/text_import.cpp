@@ -0,0 +1,147 @@
+#include "text_import.h"
+
+#include "mapped_file.h"
+#include "sheet.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <memory>
+
+namespace {
+
+// Меньшие куски не окупают передачу между потоками
+constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+
+struct Chunk {
+  std::string_view data;
+  int first_row = 0;
+};
+
+// Дробит data на куски примерно одного размера, каждый кусок заканчивается
+// переводом строки или концом данных
+std::vector<Chunk> SplitIntoChunks(std::string_view data, size_t chunk_count) {
+  std::vector<Chunk> chunks;
+  const size_t target = std::max(MIN_CHUNK_BYTES, data.size() / chunk_count + 1);
+  size_t begin = 0;
+  while (begin < data.size()) {
+    size_t end = std::min(begin + target, data.size());
+    if (end < data.size()) {
+      end = data.find('\n', end - 1);
+      end = end == std::string_view::npos ? data.size() : end + 1;
+    }
+    chunks.push_back({data.substr(begin, end - begin)});
+    begin = end;
+  }
+  return chunks;
+}
+
+size_t CountLines(std::string_view data) {
+  size_t lines = 0;
+  const char *it = data.data();
+  const char *end = it + data.size();
+  while ((it = static_cast<const char *>(std::memchr(it, '\n', end - it)))) {
+    ++lines;
+    ++it;
+  }
+  return lines;
+}
+
+void TokenizeChunk(const Chunk &chunk, char delimiter,
+                   std::vector<std::pair<Position, std::string>> &cells) {
+  std::string_view rest = chunk.data;
+  int row = chunk.first_row;
+  while (!rest.empty()) {
+    size_t line_end = rest.find('\n');
+    std::string_view line = rest.substr(0, line_end);
+    rest.remove_prefix(line_end == std::string_view::npos ? rest.size()
+                                                          : line_end + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+
+    int col = 0;
+    while (true) {
+      const size_t field_end = line.find(delimiter);
+      std::string_view field = line.substr(0, field_end);
+      if (!field.empty()) {
+        cells.emplace_back(Position{row, col}, std::string(field));
+      }
+      if (field_end == std::string_view::npos) {
+        break;
+      }
+      line.remove_prefix(field_end + 1);
+      ++col;
+    }
+    ++row;
+  }
+}
+
+} // namespace
+
+std::vector<std::pair<Position, std::string>>
+TokenizeTexts(std::string_view data, char delimiter, size_t thread_count) {
+  thread_count = std::max<size_t>(thread_count, 1);
+  std::vector<Chunk> chunks = SplitIntoChunks(data, thread_count * 4);
+  std::vector<std::vector<std::pair<Position, std::string>>> chunk_cells(
+      chunks.size());
+
+  // Номер первой строки куска известен только после подсчёта строк во всех
+  // предыдущих, поэтому разбор идёт в два параллельных прохода
+  std::vector<size_t> line_counts(chunks.size());
+  auto count_lines = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      line_counts[i] = CountLines(chunks[i].data);
+    }
+  };
+  auto tokenize = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      TokenizeChunk(chunks[i], delimiter, chunk_cells[i]);
+    }
+  };
+
+  std::unique_ptr<ThreadPool> pool;
+  if (thread_count > 1 && chunks.size() > 1) {
+    pool = std::make_unique<ThreadPool>(thread_count);
+    pool->ParallelFor(chunks.size(), 1, count_lines);
+  } else {
+    count_lines(0, chunks.size());
+  }
+  size_t row = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    // Номера за пределами таблицы отвергнет Sheet::SetCells
+    chunks[i].first_row = static_cast<int>(std::min<size_t>(row, Position::MAX_ROWS));
+    row += line_counts[i];
+  }
+  if (pool) {
+    pool->ParallelFor(chunks.size(), 1, tokenize);
+  } else {
+    tokenize(0, chunks.size());
+  }
+
+  if (chunk_cells.size() == 1) {
+    return std::move(chunk_cells.front());
+  }
+  size_t total = 0;
+  for (const auto &cells : chunk_cells) {
+    total += cells.size();
+  }
+  std::vector<std::pair<Position, std::string>> result;
+  result.reserve(total);
+  for (auto &cells : chunk_cells) {
+    std::move(cells.begin(), cells.end(), std::back_inserter(result));
+  }
+  return result;
+}
+
+void ImportTexts(Sheet &sheet, std::string_view data, char delimiter,
+                 size_t thread_count) {
+  sheet.SetCells(TokenizeTexts(data, delimiter, thread_count));
+}
+
+void ImportTextsFromFile(Sheet &sheet, const std::string &path, char delimiter,
+                         size_t thread_count) {
+  MappedFile file(path);
+  ImportTexts(sheet, file.GetData(), delimiter, thread_count);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Загрузка таблицы в формате Sheet::PrintTexts: строки разделены '\n'
+// (допускается "\r\n"), ячейки строки — delimiter (по умолчанию табуляция,
+// для CSV — запятая). Пустые поля пропускаются, поля, начинающиеся с '=',
+// разбираются как формулы. Кавычки не поддерживаются, как и при выводе:
+// текст ячейки не может содержать разделители.
+
+// Делит data на поля. Данные режутся на куски по границам строк, и куски
+// разбираются параллельно на thread_count потоках; поле копируется в
+// строку один раз, сразу в результат.
+std::vector<std::pair<Position, std::string>> TokenizeTexts(
+    std::string_view data, char delimiter = '\t', size_t thread_count = 1);
+
+// Записывает разобранные поля в лист пакетом (Sheet::SetCells)
+void ImportTexts(Sheet& sheet, std::string_view data, char delimiter = '\t',
+                 size_t thread_count = 1);
+
+// То же для файла. Файл отображается в память и разбирается на месте.
+// Если файл не открывается, бросает std::runtime_error.
+void ImportTextsFromFile(Sheet& sheet, const std::string& path, char delimiter = '\t',
+                         size_t thread_count = 1);
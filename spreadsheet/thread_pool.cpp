@@ -0,0 +1,117 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  thread_count = std::max<size_t>(thread_count, 1);
+  for (size_t i = 0; i < thread_count; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  // Очередь 0 принадлежит потоку, вызывающему ParallelFor
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain,
+                             const std::function<void(size_t, size_t)> &body) {
+  if (count == 0) {
+    return;
+  }
+  grain = std::max<size_t>(grain, 1);
+
+  {
+    std::lock_guard lock(mutex_);
+    body_ = &body;
+    // Счётчик задаётся до того, как отрезки попадут в очереди: поток, ещё
+    // не вышедший из TryRunOne после прошлого вызова, может сразу забрать
+    // новый отрезок и уменьшить счётчик
+    pending_ = (count + grain - 1) / grain;
+    ++generation_;
+    size_t index = 0;
+    for (size_t begin = 0; begin < count; begin += grain, ++index) {
+      Queue &queue = *queues_[index % queues_.size()];
+      std::lock_guard queue_lock(queue.mutex);
+      queue.ranges.push_back({begin, std::min(begin + grain, count)});
+    }
+  }
+  wake_.notify_all();
+
+  while (TryRunOne(0)) {
+  }
+
+  std::unique_lock lock(mutex_);
+  done_.wait(lock, [this] { return pending_ == 0; });
+  body_ = nullptr;
+  if (error_) {
+    std::exception_ptr error = std::exchange(error_, nullptr);
+    std::rethrow_exception(error);
+  }
+}
+
+bool ThreadPool::TryRunOne(size_t self) {
+  Range range{};
+  bool found = false;
+  for (size_t i = 0; i < queues_.size() && !found; ++i) {
+    Queue &queue = *queues_[(self + i) % queues_.size()];
+    std::lock_guard lock(queue.mutex);
+    if (queue.ranges.empty()) {
+      continue;
+    }
+    // Из своей очереди берём последний отрезок, из чужой — первый
+    if (i == 0) {
+      range = queue.ranges.back();
+      queue.ranges.pop_back();
+    } else {
+      range = queue.ranges.front();
+      queue.ranges.pop_front();
+    }
+    found = true;
+  }
+  if (!found) {
+    return false;
+  }
+
+  try {
+    (*body_)(range.begin, range.end);
+  } catch (...) {
+    std::lock_guard lock(mutex_);
+    if (!error_) {
+      error_ = std::current_exception();
+    }
+  }
+
+  if (pending_.fetch_sub(1) == 1) {
+    std::lock_guard lock(mutex_);
+    done_.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::WorkerLoop(size_t self) {
+  size_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock lock(mutex_);
+      wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+      if (stop_) {
+        return;
+      }
+      seen_generation = generation_;
+    }
+    while (TryRunOne(self)) {
+    }
+  }
+}
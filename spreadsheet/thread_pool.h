@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы. У каждого потока своя очередь отрезков;
+// поток берёт работу с конца своей очереди, а опустошив её, забирает
+// отрезки из начала чужих очередей.
+class ThreadPool {
+public:
+    // thread_count — общее число потоков, включая вызывающий ParallelFor
+    explicit ThreadPool(size_t thread_count);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // Разбивает [0, count) на отрезки длиной не больше grain, выполняет
+    // body(begin, end) для каждого и возвращается, когда все отрезки
+    // выполнены. Вызывающий поток тоже выполняет отрезки. Первое
+    // исключение из body пробрасывается наружу.
+    void ParallelFor(size_t count, size_t grain,
+                     const std::function<void(size_t, size_t)>& body);
+
+private:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    bool TryRunOne(size_t self);
+    void WorkerLoop(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(size_t, size_t)>* body_ = nullptr;
+    size_t generation_ = 0;
+    std::atomic<size_t> pending_{0};
+    std::exception_ptr error_;
+    bool stop_ = false;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Двухуровневое хранилище объектов, адресуемых позицией ячейки.
+// Таблица разбита на блоки TILE_ROWS x TILE_COLS, блок выделяется при
+// первой записи в него. Объекты блока лежат в его собственных страницах
+// подряд в порядке создания, поэтому при построчном заполнении соседние
+// ячейки соседствуют и в памяти. Страницы растут геометрически (4, 4, 8, ...,
+// 128 объектов), так что почти пустой блок занимает немного, а адреса
+// объектов стабильны до их удаления.
+template <typename T>
+class TiledGrid {
+public:
+    static constexpr int TILE_ROWS = 16;
+    static constexpr int TILE_COLS = 16;
+
+    TiledGrid() = default;
+    TiledGrid(const TiledGrid&) = delete;
+    TiledGrid& operator=(const TiledGrid&) = delete;
+
+    T* Find(Position pos) {
+        Tile* tile = FindTile(pos);
+        return tile ? tile->Find(IndexInTile(pos)) : nullptr;
+    }
+
+    const T* Find(Position pos) const {
+        return const_cast<TiledGrid*>(this)->Find(pos);
+    }
+
+    // Создаёт объект на свободной позиции
+    template <typename... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        T& object = GetOrCreateTile(pos).Emplace(IndexInTile(pos), std::forward<Args>(args)...);
+        ++size_;
+        return object;
+    }
+
+    void Erase(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (tile && tile->Erase(IndexInTile(pos))) {
+            --size_;
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Обходит все объекты: блоки по строкам, внутри блока построчно.
+    template <typename Visitor>
+    void ForEach(Visitor&& visitor) const {
+        const_cast<TiledGrid*>(this)->ForEach([&visitor](Position pos, const T& object) {
+            visitor(pos, object);
+        });
+    }
+
+    template <typename Visitor>
+    void ForEach(Visitor&& visitor) {
+        for (int tile_row = 0; tile_row < static_cast<int>(tiles_.size()); ++tile_row) {
+            const auto& row = tiles_[tile_row];
+            for (int tile_col = 0; tile_col < static_cast<int>(row.size()); ++tile_col) {
+                Tile* tile = row[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                for (int index = 0; index < TILE_AREA; ++index) {
+                    if (T* object = tile->Find(index)) {
+                        Position pos{tile_row * TILE_ROWS + index / TILE_COLS,
+                                     tile_col * TILE_COLS + index % TILE_COLS};
+                        visitor(pos, *object);
+                    }
+                }
+            }
+        }
+    }
+
+    // Обходит объекты в прямоугольнике [first, last] (границы включительно):
+    // блоки по строкам, внутри блока построчно. Невыделенные блоки
+    // пропускаются целиком.
+    template <typename Visitor>
+    void ForEachInRange(Position first, Position last, Visitor&& visitor) const {
+        const_cast<TiledGrid*>(this)->ForEachInRange(
+            first, last, [&visitor](Position pos, const T& object) {
+                visitor(pos, object);
+            });
+    }
+
+    template <typename Visitor>
+    void ForEachInRange(Position first, Position last, Visitor&& visitor) {
+        const int last_tile_row =
+            std::min(last.row / TILE_ROWS, static_cast<int>(tiles_.size()) - 1);
+        for (int tile_row = first.row / TILE_ROWS; tile_row <= last_tile_row; ++tile_row) {
+            const auto& row = tiles_[tile_row];
+            const int last_tile_col =
+                std::min(last.col / TILE_COLS, static_cast<int>(row.size()) - 1);
+            for (int tile_col = first.col / TILE_COLS; tile_col <= last_tile_col; ++tile_col) {
+                Tile* tile = row[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                const int row_begin = std::max(first.row, tile_row * TILE_ROWS);
+                const int row_end = std::min(last.row + 1, (tile_row + 1) * TILE_ROWS);
+                const int col_begin = std::max(first.col, tile_col * TILE_COLS);
+                const int col_end = std::min(last.col + 1, (tile_col + 1) * TILE_COLS);
+                for (int r = row_begin; r < row_end; ++r) {
+                    for (int c = col_begin; c < col_end; ++c) {
+                        if (T* object = tile->Find(IndexInTile({r, c}))) {
+                            visitor(Position{r, c}, *object);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int TILE_AREA = TILE_ROWS * TILE_COLS;
+    static constexpr int FIRST_PAGE_SIZE = 4;
+    static constexpr int PAGE_COUNT = 7;  // 4 + 4 + 8 + ... + 128 == TILE_AREA
+    static constexpr uint16_t NO_SLOT = 0xFFFF;
+
+    struct alignas(T) Storage {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    class Tile {
+    public:
+        Tile() {
+            slots_.fill(NO_SLOT);
+        }
+
+        Tile(const Tile&) = delete;
+        Tile& operator=(const Tile&) = delete;
+
+        ~Tile() {
+            for (uint16_t slot : slots_) {
+                if (slot != NO_SLOT) {
+                    At(slot)->~T();
+                }
+            }
+        }
+
+        T* Find(int index) const {
+            uint16_t slot = slots_[index];
+            return slot == NO_SLOT ? nullptr : At(slot);
+        }
+
+        template <typename... Args>
+        T& Emplace(int index, Args&&... args) {
+            assert(slots_[index] == NO_SLOT);
+            uint16_t slot = AllocateSlot();
+            T* object;
+            try {
+                object = new (At(slot)) T(std::forward<Args>(args)...);
+            } catch (...) {
+                free_slots_.push_back(slot);
+                throw;
+            }
+            slots_[index] = slot;
+            return *object;
+        }
+
+        bool Erase(int index) {
+            uint16_t slot = slots_[index];
+            if (slot == NO_SLOT) {
+                return false;
+            }
+            At(slot)->~T();
+            slots_[index] = NO_SLOT;
+            free_slots_.push_back(slot);
+            return true;
+        }
+
+    private:
+        // Номер страницы и смещение в ней для порядкового номера объекта
+        static std::pair<int, int> Locate(int slot) {
+            if (slot < FIRST_PAGE_SIZE) {
+                return {0, slot};
+            }
+            int page = 1;
+            int page_begin = FIRST_PAGE_SIZE;
+            while (slot >= page_begin * 2) {
+                page_begin *= 2;
+                ++page;
+            }
+            return {page, slot - page_begin};
+        }
+
+        static int PageSize(int page) {
+            return page == 0 ? FIRST_PAGE_SIZE : FIRST_PAGE_SIZE << (page - 1);
+        }
+
+        uint16_t AllocateSlot() {
+            if (!free_slots_.empty()) {
+                uint16_t slot = free_slots_.back();
+                free_slots_.pop_back();
+                return slot;
+            }
+            auto [page, offset] = Locate(used_);
+            if (offset == 0) {
+                // без value-инициализации: память под объекты не обнуляется
+                pages_[page].reset(new Storage[PageSize(page)]);
+            }
+            return used_++;
+        }
+
+        T* At(uint16_t slot) const {
+            auto [page, offset] = Locate(slot);
+            return std::launder(reinterpret_cast<T*>(pages_[page].get() + offset));
+        }
+
+        // Для каждой позиции блока — номер объекта в страницах или NO_SLOT
+        std::array<uint16_t, TILE_AREA> slots_;
+        std::array<std::unique_ptr<Storage[]>, PAGE_COUNT> pages_;
+        uint16_t used_ = 0;
+        std::vector<uint16_t> free_slots_;
+    };
+
+    static int IndexInTile(Position pos) {
+        return (pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS;
+    }
+
+    Tile* FindTile(Position pos) const {
+        size_t tile_row = pos.row / TILE_ROWS;
+        size_t tile_col = pos.col / TILE_COLS;
+        if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+            return nullptr;
+        }
+        return tiles_[tile_row][tile_col].get();
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        size_t tile_row = pos.row / TILE_ROWS;
+        size_t tile_col = pos.col / TILE_COLS;
+        if (tile_row >= tiles_.size()) {
+            tiles_.resize(tile_row + 1);
+        }
+        auto& row = tiles_[tile_row];
+        if (tile_col >= row.size()) {
+            row.resize(tile_col + 1);
+        }
+        if (!row[tile_col]) {
+            row[tile_col] = std::make_unique<Tile>();
+        }
+        return *row[tile_col];
+    }
+
+    // Каталог блоков растёт только до фактически занятых строк и столбцов
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+    size_t size_ = 0;
+};
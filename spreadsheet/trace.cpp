@@ -0,0 +1,171 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef SPREADSHEET_TRACE
+
+namespace {
+
+// Ячейка буфера. Поля атомарны, чтобы выгрузка могла читать ячейку
+// одновременно с записью; sequence — номер события плюс один после
+// записи и BUSY во время неё. Писатель занимает ячейку сменой sequence на
+// BUSY через CAS, так что после переполнения двое не пишут в одну ячейку.
+// Выгрузка принимает ячейку, только если sequence до и после чтения полей
+// совпадает с ожидаемым номером.
+struct Slot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<const char *> name{nullptr};
+  std::atomic<uint64_t> start_ns{0};
+  std::atomic<uint64_t> duration_ns{0};
+  std::atomic<uint64_t> position{0};
+  std::atomic<uint32_t> thread{0};
+};
+
+constexpr uint64_t BUSY = UINT64_MAX;
+constexpr uint64_t MASK = Trace::CAPACITY - 1;
+static_assert((Trace::CAPACITY & MASK) == 0);
+
+Slot slots[Trace::CAPACITY];
+std::atomic<uint64_t> head{0};
+// События, не записанные из-за занятой или уже перезаписанной ячейки
+std::atomic<uint64_t> lost{0};
+std::atomic<bool> recording{false};
+std::atomic<int64_t> origin_ns{0};
+std::atomic<uint32_t> next_thread{0};
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t SinceStartNs() {
+  return static_cast<uint64_t>(NowNs() -
+                               origin_ns.load(std::memory_order_relaxed));
+}
+
+// Короткий номер потока для поля tid
+uint32_t ThreadId() {
+  thread_local const uint32_t id =
+      next_thread.fetch_add(1, std::memory_order_relaxed) + 1;
+  return id;
+}
+
+void Record(const char *name, Position pos, uint64_t start_ns,
+            uint64_t duration_ns) {
+  const uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+  Slot &slot = slots[index & MASK];
+  // Ячейку пишет другой поток, обогнавший кольцо, или в ней уже событие
+  // новее: это событие пропадает, как затёртое
+  uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  if (sequence == BUSY || sequence > index ||
+      !slot.sequence.compare_exchange_strong(sequence, BUSY,
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed)) {
+    lost.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // Поля пишутся с release: выгрузка, прочитавшая новое поле, увидит и
+  // BUSY в sequence
+  slot.name.store(name, std::memory_order_release);
+  slot.start_ns.store(start_ns, std::memory_order_release);
+  slot.duration_ns.store(duration_ns, std::memory_order_release);
+  slot.position.store(pos.GetKey(), std::memory_order_release);
+  slot.thread.store(ThreadId(), std::memory_order_release);
+  slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+} // namespace
+
+void Trace::Start() {
+  recording.store(false, std::memory_order_relaxed);
+  for (Slot &slot : slots) {
+    slot.sequence.store(0, std::memory_order_relaxed);
+  }
+  head.store(0, std::memory_order_relaxed);
+  lost.store(0, std::memory_order_relaxed);
+  origin_ns.store(NowNs(), std::memory_order_relaxed);
+  recording.store(true, std::memory_order_release);
+}
+
+void Trace::Stop() { recording.store(false, std::memory_order_release); }
+
+bool Trace::IsRecording() {
+  return recording.load(std::memory_order_relaxed);
+}
+
+uint64_t Trace::GetDroppedCount() {
+  const uint64_t count = head.load(std::memory_order_acquire);
+  return (count > CAPACITY ? count - CAPACITY : 0) +
+         lost.load(std::memory_order_relaxed);
+}
+
+Trace::Scope::Scope(const char *name, Position pos)
+    : name_(IsRecording() ? name : nullptr), pos_(pos),
+      start_ns_(name_ ? SinceStartNs() : 0) {}
+
+Trace::Scope::~Scope() {
+  if (name_) {
+    Record(name_, pos_, start_ns_, SinceStartNs() - start_ns_);
+  }
+}
+
+#else
+
+void Trace::Start() {}
+void Trace::Stop() {}
+bool Trace::IsRecording() { return false; }
+uint64_t Trace::GetDroppedCount() { return 0; }
+
+#endif
+
+void Trace::WriteChromeJson(std::ostream &output) {
+  output << "{\"traceEvents\":[";
+#ifdef SPREADSHEET_TRACE
+  const uint64_t count = head.load(std::memory_order_acquire);
+  const uint64_t first = count > CAPACITY ? count - CAPACITY : 0;
+  bool separator = false;
+  for (uint64_t index = first; index < count; ++index) {
+    const Slot &slot = slots[index & MASK];
+    if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+      continue;
+    }
+    const char *name = slot.name.load(std::memory_order_acquire);
+    const uint64_t start_ns = slot.start_ns.load(std::memory_order_acquire);
+    const uint64_t duration_ns =
+        slot.duration_ns.load(std::memory_order_acquire);
+    const Position pos =
+        Position::FromKey(slot.position.load(std::memory_order_acquire));
+    const uint32_t thread = slot.thread.load(std::memory_order_acquire);
+    // Ячейку затёрли, пока поля читались
+    if (slot.sequence.load(std::memory_order_relaxed) != index + 1) {
+      continue;
+    }
+
+    // Время в микросекундах, как принято в формате
+    output << (separator ? ",\n" : "\n") << "{\"name\":\"" << name
+           << "\",\"cat\":\"spreadsheet\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+           << thread << ",\"ts\":" << start_ns / 1000 << '.'
+           << start_ns % 1000 / 100 << ",\"dur\":" << duration_ns / 1000
+           << '.' << duration_ns % 1000 / 100;
+    if (pos.IsValid()) {
+      output << ",\"args\":{\"cell\":\"" << pos.ToString() << "\"}";
+    }
+    output << '}';
+    separator = true;
+  }
+#endif
+  output << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":"
+         << GetDroppedCount() << "}}\n";
+}
+
+void Trace::SaveChromeJson(const std::string &path) {
+  std::ofstream output(path);
+  WriteChromeJson(output);
+  if (!output) {
+    throw std::runtime_error("Trace: cannot write " + path);
+  }
+}
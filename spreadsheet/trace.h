@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Трассировка правок и пересчёта: именованные интервалы (разбор, проверка
+// циклов, замена ссылок, сброс кэшей, вычисление) с позицией ячейки
+// записываются в общий кольцевой буфер и выгружаются в формате Chrome
+// trace (chrome://tracing, ui.perfetto.dev).
+//
+// Собирается, только если проект собран с SPREADSHEET_TRACE; иначе Scope
+// пуст, а выгрузка даёт трассу без событий. Со сборкой события пишутся
+// только между Start и Stop, вне их Scope стоит одной атомарной загрузки.
+// Запись без блокировок из любых потоков; при переполнении старые события
+// затираются новыми. Если ячейку кольца в этот момент пишет другой поток,
+// новое событие отбрасывается и учитывается в GetDroppedCount.
+class Trace {
+public:
+    static constexpr bool ENABLED =
+#ifdef SPREADSHEET_TRACE
+        true;
+#else
+        false;
+#endif
+    // Ёмкость буфера в событиях
+    static constexpr size_t CAPACITY = size_t{1} << 16;
+
+    // Очищает буфер и начинает запись; время событий отсчитывается от Start
+    static void Start();
+    static void Stop();
+    static bool IsRecording();
+
+    // Число событий, затёртых или отброшенных из-за переполнения с
+    // последнего Start
+    static uint64_t GetDroppedCount();
+
+    // Выгружает записанные события в JSON Chrome trace. Вызывается после
+    // Stop: события, которые пишутся во время выгрузки, могут пропасть.
+    static void WriteChromeJson(std::ostream& output);
+    static void SaveChromeJson(const std::string& path);
+
+    // Интервал от создания до уничтожения. name — строковый литерал.
+    class Scope {
+    public:
+#ifdef SPREADSHEET_TRACE
+        explicit Scope(const char* name, Position pos = Position::NONE);
+        ~Scope();
+#else
+        explicit Scope(const char*, Position = Position::NONE) {
+        }
+#endif
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+#ifdef SPREADSHEET_TRACE
+    private:
+        const char* name_;
+        Position pos_;
+        uint64_t start_ns_;
+#endif
+    };
+};